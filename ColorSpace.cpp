@@ -0,0 +1,239 @@
+/*
+  color space conversions and the palette matcher.
+
+  going from sRGB bytes to any of the spaces starts with the 256 entry gamma
+  table. OKLab and CIELAB both need cube roots, which are done with a bit
+  trick estimate refined by two halley steps(good to float precision) instead
+  of cbrtf, so the conversion stays a handful of multiply-adds.
+*/
+
+#include "ColorSpace.h"
+#include "Kernels.h"
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <cinttypes>
+
+const char* colorSpaceName(ColorSpace space) {
+    switch (space) {
+        case SPACE_LINEAR: return "linear RGB";
+        case SPACE_LAB:    return "CIELAB";
+        case SPACE_OKLAB:  return "OKLab";
+        default:           return "sRGB";
+    }
+}
+
+// 256 entry table from sRGB bytes to linear light
+struct GammaTable {
+    float linear[256];
+
+    GammaTable() {
+        for (int i = 0; i < 256; ++i) {
+            double v = i / 255.0;
+            linear[i] = (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+        }
+    }
+};
+
+const float* srgbToLinearTable() {
+    static const GammaTable table;
+    return table.linear;
+}
+
+unsigned char linearToSrgb(float value) {
+
+    if (value <= 0.0f) return 0;
+    if (value >= 1.0f) return 255;
+
+    double v = value <= 0.0031308f ? 12.92 * value : 1.055 * pow((double)value, 1.0 / 2.4) - 0.055;
+    return (unsigned char)(v * 255.0 + 0.5);
+}
+
+static inline float fastCbrt(float x) {
+
+    if (x == 0.0f)
+        return 0.0f;
+
+    bool negative = x < 0.0f;
+    if (negative)
+        x = -x;
+
+    // divide the exponent by 3 for a rough first guess
+    std::uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = bits / 3 + 709921077u;
+    float y;
+    memcpy(&y, &bits, sizeof(y));
+
+    // halley's method converges cubically, two steps are plenty
+    for (int i = 0; i < 2; ++i) {
+        float y3 = y * y * y;
+        y = y * (y3 + 2.0f * x) / (2.0f * y3 + x);
+    }
+
+    return negative ? -y : y;
+}
+
+// CIELAB helpers, D65 white point
+#define LAB_EPSILON (216.0f / 24389.0f)  // (6/29)^3
+#define LAB_KAPPA (24389.0f / 27.0f)
+
+static inline float labF(float t) {
+    return t > LAB_EPSILON ? fastCbrt(t) : (LAB_KAPPA * t + 16.0f) / 116.0f;
+}
+
+static inline float labFInverse(float t) {
+    float t3 = t * t * t;
+    return t3 > LAB_EPSILON ? t3 : (116.0f * t - 16.0f) / LAB_KAPPA;
+}
+
+void linearToSpace(ColorSpace space, const float rgb[3], float out[3]) {
+
+    float r = rgb[0], g = rgb[1], b = rgb[2];
+
+    switch (space) {
+        case SPACE_SRGB:
+            out[0] = linearToSrgb(r);
+            out[1] = linearToSrgb(g);
+            out[2] = linearToSrgb(b);
+            break;
+        case SPACE_LINEAR:
+            out[0] = r;
+            out[1] = g;
+            out[2] = b;
+            break;
+        case SPACE_LAB: {
+            float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f;
+            float y =  0.2126729f * r + 0.7151522f * g + 0.0721750f * b;
+            float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f;
+            float fx = labF(x), fy = labF(y), fz = labF(z);
+            out[0] = 116.0f * fy - 16.0f;
+            out[1] = 500.0f * (fx - fy);
+            out[2] = 200.0f * (fy - fz);
+            break;
+        }
+        case SPACE_OKLAB: {
+            float l = fastCbrt(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+            float m = fastCbrt(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+            float s = fastCbrt(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+            out[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+            out[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+            out[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+            break;
+        }
+    }
+}
+
+void spaceToLinear(ColorSpace space, const float in[3], float rgb[3]) {
+
+    switch (space) {
+        case SPACE_SRGB: {
+            const float *table = srgbToLinearTable();
+            for (int c = 0; c < 3; ++c) {
+                float v = in[c] < 0.0f ? 0.0f : in[c] > 255.0f ? 255.0f : in[c];
+                rgb[c] = table[(int)(v + 0.5f)];
+            }
+            break;
+        }
+        case SPACE_LINEAR:
+            rgb[0] = in[0];
+            rgb[1] = in[1];
+            rgb[2] = in[2];
+            break;
+        case SPACE_LAB: {
+            float fy = (in[0] + 16.0f) / 116.0f;
+            float fx = fy + in[1] / 500.0f;
+            float fz = fy - in[2] / 200.0f;
+            float x = labFInverse(fx) * 0.95047f;
+            float y = labFInverse(fy);
+            float z = labFInverse(fz) * 1.08883f;
+            rgb[0] =  3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+            rgb[1] = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+            rgb[2] =  0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+            break;
+        }
+        case SPACE_OKLAB: {
+            float l = in[0] + 0.3963377774f * in[1] + 0.2158037573f * in[2];
+            float m = in[0] - 0.1055613458f * in[1] - 0.0638541728f * in[2];
+            float s = in[0] - 0.0894841775f * in[1] - 1.2914855480f * in[2];
+            l = l * l * l;
+            m = m * m * m;
+            s = s * s * s;
+            rgb[0] =  4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+            rgb[1] = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+            rgb[2] = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+            break;
+        }
+    }
+}
+
+void srgbToSpace(ColorSpace space, unsigned char r, unsigned char g, unsigned char b, float out[3]) {
+
+    if (space == SPACE_SRGB) {
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        return;
+    }
+
+    const float *table = srgbToLinearTable();
+    float rgb[3] = { table[r], table[g], table[b] };
+    linearToSpace(space, rgb, out);
+}
+
+pixel spaceToSrgb(ColorSpace space, const float in[3]) {
+
+    if (space == SPACE_SRGB) {
+        unsigned char c[3];
+        for (int i = 0; i < 3; ++i) {
+            float v = in[i] < 0.0f ? 0.0f : in[i] > 255.0f ? 255.0f : in[i];
+            c[i] = (unsigned char)(v + 0.5f);
+        }
+        return pixel(c[0], c[1], c[2], 255);
+    }
+
+    float rgb[3];
+    spaceToLinear(space, in, rgb);
+    return pixel(linearToSrgb(rgb[0]), linearToSrgb(rgb[1]), linearToSrgb(rgb[2]), 255);
+}
+
+PaletteMatcher::PaletteMatcher(const std::vector<pixel> &palette, ColorSpace space) :
+space(space), c0(palette.size()), c1(palette.size()), c2(palette.size())
+{
+    for (size_t i = 0; i < palette.size(); ++i) {
+        float color[3];
+        srgbToSpace(space, palette[i].r, palette[i].g, palette[i].b, color);
+        c0[i] = color[0];
+        c1[i] = color[1];
+        c2[i] = color[2];
+    }
+}
+
+int PaletteMatcher::closest(const float color[3]) const {
+
+    float smallest = std::numeric_limits<float>::max();
+    int palette_index = -1;
+
+    const float *p0 = c0.data(), *p1 = c1.data(), *p2 = c2.data();
+    for (int i = 0, n = (int)c0.size(); i < n; ++i) {
+        float d0 = p0[i] - color[0];
+        float d1 = p1[i] - color[1];
+        float d2 = p2[i] - color[2];
+        float diff = d0 * d0 + d1 * d1 + d2 * d2;
+        if (diff < smallest) {
+            smallest = diff;
+            palette_index = i;
+        }
+    }
+
+    return palette_index;
+}
+
+void PaletteMatcher::closest(const float *points, size_t n, int *indices) const {
+    kernels().nearest(points, n, c0.data(), c1.data(), c2.data(), (int)c0.size(), indices);
+}
+
+void PaletteMatcher::toSpace(const unsigned char *rgba, size_t n, float *points) const {
+    for (size_t i = 0; i < n; ++i, rgba += 4, points += 3)
+        srgbToSpace(space, rgba[0], rgba[1], rgba[2], points);
+}
@@ -0,0 +1,69 @@
+// Header file for the color spaces used to compare colors.
+// plain sRGB distances treat a step in the darks the same as a step in the
+// lights, which is not how we see them. palette generation, palette lookup and
+// error diffusion can all be told to measure distances in a perceptual space
+// instead. conversions out of sRGB go through a 256 entry gamma table so the
+// per pixel cost is a few lookups and multiply-adds
+
+#ifndef COLOR_SPACE_H
+#define COLOR_SPACE_H
+
+#include "pixel.h"
+#include <vector>
+
+enum ColorSpace {
+    SPACE_SRGB,    // the raw byte values, what we always used
+    SPACE_LINEAR,  // linear light RGB
+    SPACE_LAB,     // CIE L*a*b* (D65)
+    SPACE_OKLAB    // Bjorn Ottosson's OKLab
+};
+
+const char* colorSpaceName(ColorSpace space);
+
+// sRGB byte -> linear light in [0, 1]
+const float* srgbToLinearTable();
+
+// conversions between linear light RGB and the given space
+void linearToSpace(ColorSpace space, const float rgb[3], float out[3]);
+void spaceToLinear(ColorSpace space, const float in[3], float rgb[3]);
+
+// sRGB byte triple -> coordinates in the given space
+void srgbToSpace(ColorSpace space, unsigned char r, unsigned char g, unsigned char b, float out[3]);
+
+// coordinates in the given space -> the nearest sRGB pixel(opaque)
+pixel spaceToSrgb(ColorSpace space, const float in[3]);
+
+// linear light value -> sRGB byte
+unsigned char linearToSrgb(float value);
+
+// a palette converted into the matching space once, stored channel by channel
+// so that the distance loop over the palette vectorizes
+class PaletteMatcher {
+private:
+    ColorSpace space;
+    std::vector<float> c0, c1, c2;
+public:
+    PaletteMatcher(const std::vector<pixel> &palette, ColorSpace space);
+
+    ColorSpace getSpace() const { return space; }
+
+    // index of the closest palette entry to a point already in the matching space
+    int closest(const float color[3]) const;
+
+    // index of the closest palette entry to an sRGB color. for SPACE_SRGB this
+    // is exactly what findClosestPaletteColor returns
+    int closest(unsigned char r, unsigned char g, unsigned char b) const {
+        float color[3];
+        srgbToSpace(space, r, g, b, color);
+        return closest(color);
+    }
+
+    // the closest palette entries for n points in the matching space(xyz triples),
+    // done by the vectorized kernel
+    void closest(const float *points, size_t n, int *indices) const;
+
+    // convert n RGBA pixels into the matching space, ready for closest()
+    void toSpace(const unsigned char *rgba, size_t n, float *points) const;
+};
+
+#endif
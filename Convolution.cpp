@@ -0,0 +1,402 @@
+/*
+  the convolution engine behind the spatial filters.
+
+  the image is cut into tiles small enough for their intermediate rows to stay
+  in the L2 cache. for every tile, the rows it needs(plus the kernel's reach
+  above and below) are filtered horizontally into a scratch buffer of Q4 fixed
+  point values, then the columns of that buffer are filtered into a new
+  pixmap. weights are Q12 fixed point. the tiles don't depend on each other so
+  they are spread over all the cores, and the inner loops are the
+  convolveRow/convolveColumn kernels, built per instruction set.
+
+  kernels that don't separate are run as one horizontal pass per kernel row,
+  summed up by a vertical pass with unit weights. pixels past the edges
+  repeat the edge pixel.
+
+  a filter limited to a region only tiles that region. the tiles still read
+  the pixels around it, but write into a buffer the size of the region that
+  is copied back once every tile is done.
+*/
+
+#include "Image.h"
+#include "RowSpan.h"
+#include "Kernels.h"
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#define FIXED_ONE (1 << 12)         // Q12 weights
+#define MAX_TAP 32767               // largest Q12 weight a short holds
+#define TILE_ROWS 64                // output rows per tile
+#define TILE_SCRATCH (256 * 1024)   // bytes of intermediate rows per tile, about an L2
+#define MAX_ROW_WEIGHT 8.0          // taps and Q4 intermediates have to fit in 16 bits
+#define MAX_TOTAL_WEIGHT 64.0       // and the vertical sums in 32
+
+// a 1d kernel in fixed point, 2 * radius + 1 taps centered on the pixel
+struct Taps {
+    std::vector<short> weights;
+    int radius;
+};
+
+static double absoluteSum(const float *kernel, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += fabs(kernel[i]);
+    return sum;
+}
+
+// kernels adding up to one still add up to exactly one after rounding(the
+// difference goes to the center tap), so that flat areas and opaque alpha
+// come out unchanged. a tap just under MAX_ROW_WEIGHT can round past what a
+// short holds, those saturate instead of wrapping around to the other sign
+static Taps quantize(const float *kernel, size_t n, bool normalized) {
+
+    Taps taps;
+    taps.radius = (int)n / 2;
+    taps.weights.resize(n);
+
+    int total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        long weight = lround(kernel[i] * FIXED_ONE);
+        taps.weights[i] = (short)std::min(std::max(weight, -(long)MAX_TAP), (long)MAX_TAP);
+        total += taps.weights[i];
+    }
+    if (normalized)
+        taps.weights[taps.radius] += FIXED_ONE - total;
+
+    return taps;
+}
+
+static bool sumsToOne(const float *kernel, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += kernel[i];
+    return fabs(sum - 1.0) < 1e-3;
+}
+
+static std::vector<ImageRect> filterTiles(const ImageRect &area, int radius) {
+
+    // as wide as the scratch budget allows for a tile's rows and the rows it reaches
+    size_t rowBytes = (TILE_ROWS + 2 * (size_t)radius) * 4 * sizeof(short);
+    int tileWidth = std::max(64, (int)(TILE_SCRATCH / rowBytes));
+
+    return makeTiles(area, tileWidth, TILE_ROWS);
+}
+
+// the pixels of a row from x0 - radius to x1 + radius, edge pixels repeated
+static void paddedRow(const unsigned char *row, int width, int x0, int x1, int radius, unsigned char *out) {
+
+    int first = x0 - radius, last = x1 + radius;
+    int inside0 = std::max(first, 0), inside1 = std::min(last, width);
+
+    for (int x = first; x < inside0; ++x)
+        memcpy(out + 4 * (x - first), row, 4);
+    memcpy(out + 4 * (inside0 - first), row + 4 * inside0, 4 * (size_t)(inside1 - inside0));
+    for (int x = inside1; x < last; ++x)
+        memcpy(out + 4 * (x - first), row + 4 * (width - 1), 4);
+}
+
+// row y of the tile in the filtered pixels, which hold just the area being
+// filtered(its top left corner is their first pixel)
+static unsigned char* filteredRow(Image &filtered, const ImageRect &area, const ImageRect &tile, int y) {
+    return filtered.row(y - area.y0) + 4 * (size_t)(tile.x0 - area.x0);
+}
+
+// kernels that don't add up to one(edge detection and the like) would wipe
+// out alpha, so it is copied over unfiltered for those
+static void copyAlpha(Image &source, Image &filtered, const ImageRect &area, const ImageRect &tile) {
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        RowSpan from = tile.rowSpan(source, y);
+        unsigned char *to = filteredRow(filtered, area, tile, y);
+        for (int x = 0; x < from.width; ++x)
+            to[4 * x + 3] = from.at(x)[3];
+    }
+}
+
+static void separableTile(Image &source, Image &filtered, const ImageRect &area, const ImageRect &tile,
+                          const Taps &horizontal, const Taps &vertical) {
+
+    const KernelTable &k = kernels();
+    int width = source.getWidth(), height = source.getHeight();
+    size_t span = 4 * (size_t)(tile.x1 - tile.x0);  // bytes across the tile
+    int rv = vertical.radius;
+
+    // every row the tile's columns reach
+    int first = std::max(0, tile.y0 - rv), last = std::min(height, tile.y1 + rv);
+
+    std::vector<unsigned char> padded(span + 8 * (size_t)horizontal.radius);
+    std::vector<short> scratch((last - first) * span);
+    for (int y = first; y < last; ++y) {
+        paddedRow(source.row(y), width, tile.x0, tile.x1, horizontal.radius, padded.data());
+        k.convolveRow(padded.data(), &scratch[(y - first) * span], span,
+                      horizontal.weights.data(), (int)horizontal.weights.size());
+    }
+
+    std::vector<const short*> rows(2 * rv + 1);
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int j = -rv; j <= rv; ++j) {
+            int sy = std::min(height - 1, std::max(0, y + j));
+            rows[j + rv] = &scratch[(sy - first) * span];
+        }
+        k.convolveColumn(rows.data(), filteredRow(filtered, area, tile, y), span,
+                         vertical.weights.data(), (int)vertical.weights.size());
+    }
+}
+
+// a kernel that doesn't separate: every output row sums one horizontal pass
+// per kernel row, each over a different input row
+static void denseTile(Image &source, Image &filtered, const ImageRect &area, const ImageRect &tile,
+                      const std::vector<Taps> &kernelRows, const Taps &unit) {
+
+    const KernelTable &k = kernels();
+    int width = source.getWidth(), height = source.getHeight();
+    size_t span = 4 * (size_t)(tile.x1 - tile.x0);
+    int r = unit.radius;
+
+    std::vector<unsigned char> padded(span + 8 * (size_t)r);
+    std::vector<short> scratch((2 * r + 1) * span);
+    std::vector<const short*> rows(2 * r + 1);
+    for (int j = 0; j <= 2 * r; ++j)
+        rows[j] = &scratch[j * span];
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int j = -r; j <= r; ++j) {
+            int sy = std::min(height - 1, std::max(0, y + j));
+            paddedRow(source.row(sy), width, tile.x0, tile.x1, r, padded.data());
+            k.convolveRow(padded.data(), &scratch[(j + r) * span], span,
+                          kernelRows[j + r].weights.data(), 2 * r + 1);
+        }
+        k.convolveColumn(rows.data(), filteredRow(filtered, area, tile, y), span,
+                         unit.weights.data(), 2 * r + 1);
+    }
+}
+
+// the area(inside the image) filtered by kernels that were checked already,
+// without touching the image
+Image Image::separableRegion(const std::vector<float> &horizontal, const std::vector<float> &vertical,
+                             const ImageRect &area) {
+
+    Taps th = quantize(horizontal.data(), horizontal.size(), sumsToOne(horizontal.data(), horizontal.size()));
+    Taps tv = quantize(vertical.data(), vertical.size(), sumsToOne(vertical.data(), vertical.size()));
+
+    bool keepAlpha = !sumsToOne(horizontal.data(), horizontal.size()) ||
+                     !sumsToOne(vertical.data(), vertical.size());
+
+    Image filtered(area.x1 - area.x0, area.y1 - area.y0, channels);
+    parallelTiles(filterTiles(area, std::max(th.radius, tv.radius)), [&](const ImageRect &tile) {
+        separableTile(*this, filtered, area, tile, th, tv);
+        if (keepAlpha)
+            copyAlpha(*this, filtered, area, tile);
+    });
+
+    return filtered;
+}
+
+// put the filtered pixels of the area in place, with only the area added to
+// what is dirty. a filtered whole image is taken over as it is
+void Image::takeRegion(Image &&filtered, const ImageRect &area) {
+
+    if (filtered.width == width && filtered.height == height) {
+        DirtyRegion before = takeDirty();
+        *this = std::move(filtered);
+        dirty = before;
+    }
+    else {
+        size_t bytes = 4 * (size_t)(area.x1 - area.x0);
+        parallelBands(area.y0, area.y1, TILE_ROWS, [&](int first, int last) {
+            for (int y = first; y < last; ++y)
+                memcpy(area.rowSpan(*this, y).data, filtered.row(y - area.y0), bytes);
+        });
+    }
+
+    markDirty(area);
+}
+
+bool Image::convolveSeparable(const std::vector<float> &horizontal, const std::vector<float> &vertical,
+                              const ImageRect &roi) {
+
+    if (horizontal.size() % 2 == 0 || vertical.size() % 2 == 0) {
+        std::cerr << "Convolution kernels need an odd number of taps" << std::endl;
+        return false;
+    }
+
+    double h = absoluteSum(horizontal.data(), horizontal.size());
+    double v = absoluteSum(vertical.data(), vertical.size());
+    if (h >= MAX_ROW_WEIGHT || v >= MAX_ROW_WEIGHT) {
+        std::cerr << "Convolution kernel is too strong for the fixed point engine" << std::endl;
+        return false;
+    }
+
+    ImageRect area = intersect(roi, getBounds());
+    if (area.empty())
+        return true;
+
+    takeRegion(separableRegion(horizontal, vertical, area), area);
+    return true;
+}
+
+bool Image::convolve(const std::vector<float> &kernel, int size, const ImageRect &roi) {
+
+    if (size <= 0 || size % 2 == 0 || kernel.size() != (size_t)size * size) {
+        std::cerr << "Convolution kernels need to be size x size, with an odd size" << std::endl;
+        return false;
+    }
+
+    // a kernel that is the outer product of a column and a row is run as the
+    // two, found through its largest entry
+    size_t pivot = 0;
+    for (size_t i = 1; i < kernel.size(); ++i)
+        if (fabs(kernel[i]) > fabs(kernel[pivot]))
+            pivot = i;
+
+    float p = kernel[pivot];
+    if (p != 0.0f) {
+        int pr = (int)pivot / size, pc = (int)pivot % size;
+        std::vector<float> column(size), row(size);
+        for (int i = 0; i < size; ++i) {
+            column[i] = kernel[i * size + pc];
+            row[i] = kernel[pr * size + i] / p;
+        }
+
+        bool separable = true;
+        for (int i = 0; i < size && separable; ++i)
+            for (int j = 0; j < size && separable; ++j)
+                separable = fabs(kernel[i * size + j] - column[i] * row[j]) <= 1e-6 * fabs(p);
+
+        if (separable) {
+            // spread the weight evenly over the two passes
+            double scale = sqrt(absoluteSum(column.data(), size) / absoluteSum(row.data(), size));
+            for (int i = 0; i < size; ++i) {
+                row[i] = (float)(row[i] * scale);
+                column[i] = (float)(column[i] / scale);
+            }
+            return convolveSeparable(row, column, roi);
+        }
+    }
+
+    double total = absoluteSum(kernel.data(), kernel.size());
+    for (int i = 0; i < size; ++i) {
+        if (absoluteSum(&kernel[i * size], size) >= MAX_ROW_WEIGHT || total > MAX_TOTAL_WEIGHT) {
+            std::cerr << "Convolution kernel is too strong for the fixed point engine" << std::endl;
+            return false;
+        }
+    }
+
+    ImageRect area = intersect(roi, getBounds());
+    if (area.empty())
+        return true;
+
+    std::vector<Taps> kernelRows(size);
+    for (int i = 0; i < size; ++i)
+        kernelRows[i] = quantize(&kernel[i * size], size, false);
+
+    // same as quantize does, but over the whole kernel
+    bool normalized = sumsToOne(kernel.data(), kernel.size());
+    if (normalized) {
+        int sum = 0;
+        for (int i = 0; i < size; ++i)
+            for (int j = 0; j < size; ++j)
+                sum += kernelRows[i].weights[j];
+        kernelRows[size / 2].weights[size / 2] += FIXED_ONE - sum;
+    }
+
+    std::vector<float> ones(size, 1.0f);
+    Taps unit = quantize(ones.data(), size, false);
+
+    Image filtered(area.x1 - area.x0, area.y1 - area.y0, channels);
+    parallelTiles(filterTiles(area, size / 2), [&](const ImageRect &tile) {
+        denseTile(*this, filtered, area, tile, kernelRows, unit);
+        if (!normalized)
+            copyAlpha(*this, filtered, area, tile);
+    });
+
+    takeRegion(std::move(filtered), area);
+    return true;
+}
+
+static std::vector<float> gaussianKernel(float sigma) {
+
+    int radius = (int)ceil(3.0f * sigma);  // 99.7% of the weight
+    std::vector<float> kernel(2 * radius + 1);
+    double sum = 0;
+    for (int i = -radius; i <= radius; ++i) {
+        kernel[i + radius] = (float)exp(-(double)i * i / (2.0 * sigma * sigma));
+        sum += kernel[i + radius];
+    }
+    for (size_t i = 0; i < kernel.size(); ++i)
+        kernel[i] = (float)(kernel[i] / sum);
+
+    return kernel;
+}
+
+void Image::gaussianBlur(float sigma, const ImageRect &roi) {
+
+    if (sigma <= 0.0f)
+        return;
+
+    std::vector<float> kernel = gaussianKernel(sigma);
+    convolveSeparable(kernel, kernel, roi);
+}
+
+void Image::boxBlur(int radius, const ImageRect &roi) {
+
+    if (radius <= 0)
+        return;
+
+    std::vector<float> kernel(2 * radius + 1, 1.0f / (2 * radius + 1));
+    convolveSeparable(kernel, kernel, roi);
+}
+
+void Image::unsharpMask(float sigma, float amount, int threshold, const ImageRect &roi) {
+
+    ImageRect area = intersect(roi, getBounds());
+    if (sigma <= 0.0f || amount <= 0.0f || area.empty())
+        return;
+
+    // just the area gets blurred(reading the pixels within the blur's reach
+    // around it), into a buffer of its own size
+    std::vector<float> kernel = gaussianKernel(sigma);
+    Image blurred = separableRegion(kernel, kernel, area);
+
+    int fixedAmount = (int)lround(std::min(amount, 64.0f) * 256.0f);  // Q8
+
+    parallelBands(area.y0, area.y1, TILE_ROWS, [&](int first, int last) {
+        for (int y = first; y < last; ++y)
+            kernels().sharpen(area.rowSpan(*this, y).data, blurred.row(y - area.y0),
+                              (size_t)(area.x1 - area.x0), fixedAmount, threshold);
+    });
+
+    markDirty(area);
+}
+
+// one line for the check, false when it failed
+static bool expect(std::ostream &out, const char *what, bool passed) {
+    out << "filter " << what << ": " << (passed ? "ok" : "failed") << "\n";
+    return passed;
+}
+
+bool filterSelfCheck(std::ostream &out) {
+
+    bool ok = true;
+
+    // a flat grey times just under 8, the heaviest tap a row can have
+    Image flat(16, 16, 4);
+    forEachRow(flat, [](const RowSpan &row) {
+        for (int x = 0; x < row.width; ++x)
+            row.set(x, pixel(16, 16, 16, 255));
+    });
+
+    Image separable = flat.clone();
+    std::vector<float> heavy(1, 7.9999f), unit(1, 1.0f);
+    bool ran = separable.convolveSeparable(heavy, unit);
+    ok = expect(out, "one tap of 7.9999", ran && separable.pixelAt(5, 5).r == 128) && ok;
+
+    // the same tap in a kernel that doesn't separate
+    Image dense = flat.clone();
+    float weights[] = { 0, 7.9999f, 0, 0, 0, 0, 0, 0, 0.0001f };
+    ran = dense.convolve(std::vector<float>(weights, weights + 9), 3);
+    ok = expect(out, "dense tap of 7.9999", ran && dense.pixelAt(5, 5).r == 128) && ok;
+
+    return ok;
+}
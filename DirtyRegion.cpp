@@ -0,0 +1,102 @@
+/*
+  dirty rectangles. operations usually touch a handful of areas(a whole image,
+  a few ROIs), so a short list that merges whatever overlaps is plenty, and
+  it is capped so that a long series of small edits can't make it grow
+  without bound
+*/
+
+#include "DirtyRegion.h"
+#include <algorithm>
+
+#define MAX_DIRTY_RECTS 16
+
+ImageRect intersect(const ImageRect &a, const ImageRect &b) {
+    ImageRect both = { std::max(a.x0, b.x0), std::min(a.x1, b.x1),
+                       std::max(a.y0, b.y0), std::min(a.y1, b.y1) };
+    return both;
+}
+
+static bool overlaps(const ImageRect &a, const ImageRect &b) {
+    return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+static ImageRect enclose(const ImageRect &a, const ImageRect &b) {
+    ImageRect both = { std::min(a.x0, b.x0), std::max(a.x1, b.x1),
+                       std::min(a.y0, b.y0), std::max(a.y1, b.y1) };
+    return both;
+}
+
+void DirtyRegion::add(const ImageRect &rect) {
+
+    if (rect.empty())
+        return;
+
+    // grow the new rectangle over everything it overlaps, which can make it
+    // overlap rectangles it didn't before, so go again till nothing merges
+    ImageRect merged = rect;
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (size_t i = 0; i < rects.size(); ++i) {
+            if (overlaps(rects[i], merged)) {
+                merged = enclose(rects[i], merged);
+                rects[i] = rects.back();
+                rects.pop_back();
+                grew = true;
+                break;
+            }
+        }
+    }
+    rects.push_back(merged);
+
+    if (rects.size() > MAX_DIRTY_RECTS) {
+        ImageRect all = bounds();
+        rects.assign(1, all);
+    }
+}
+
+void DirtyRegion::add(const DirtyRegion &other) {
+    for (size_t i = 0; i < other.rects.size(); ++i)
+        add(other.rects[i]);
+}
+
+ImageRect DirtyRegion::bounds() const {
+
+    if (rects.empty()) {
+        ImageRect none = { 0, 0, 0, 0 };
+        return none;
+    }
+
+    ImageRect all = rects[0];
+    for (size_t i = 1; i < rects.size(); ++i)
+        all = enclose(all, rects[i]);
+    return all;
+}
+
+long long DirtyRegion::area() const {
+    long long total = 0;
+    for (size_t i = 0; i < rects.size(); ++i)
+        total += rects[i].area();  // they never overlap
+    return total;
+}
+
+std::vector<RowRange> DirtyRegion::rows() const {
+
+    std::vector<RowRange> ranges;
+    for (size_t i = 0; i < rects.size(); ++i) {
+        RowRange range = { rects[i].y0, rects[i].y1 };
+        ranges.push_back(range);
+    }
+    std::sort(ranges.begin(), ranges.end(),
+              [](const RowRange &a, const RowRange &b) { return a.first < b.first; });
+
+    std::vector<RowRange> merged;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (!merged.empty() && ranges[i].first <= merged.back().last)
+            merged.back().last = std::max(merged.back().last, ranges[i].last);
+        else
+            merged.push_back(ranges[i]);
+    }
+
+    return merged;
+}
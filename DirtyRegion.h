@@ -0,0 +1,53 @@
+// Header file for keeping track of which parts of an image changed.
+// every Image carries a DirtyRegion: its operations add the rectangles they
+// write to, and whoever mirrors the pixels somewhere else(the display's
+// texture) takes the region to copy just those parts over. nothing here knows
+// about pixels, so it can be checked without an image or a window
+
+#ifndef DIRTY_REGION_H
+#define DIRTY_REGION_H
+
+#include <vector>
+
+class Image;
+struct RowSpan;
+
+// a rectangle of an image, [x0, x1) x [y0, y1)
+struct ImageRect {
+    int x0, x1, y0, y1;
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+    long long area() const { return empty() ? 0 : (long long)(x1 - x0) * (y1 - y0); }
+
+    // the part of this row that lies in the rectangle, see RowSpan.h
+    RowSpan rowSpan(Image &image, int y) const;
+};
+
+ImageRect intersect(const ImageRect &a, const ImageRect &b);
+
+// rows [first, last)
+struct RowRange {
+    int first, last;
+};
+
+class DirtyRegion {
+private:
+    // never overlapping each other. past MAX_DIRTY_RECTS they are
+    // all folded into their bounding box, which is never less than what changed
+    std::vector<ImageRect> rects;
+public:
+    // everything added is kept till clear()
+    void add(const ImageRect &rect);
+    void add(const DirtyRegion &other);
+    void clear() { rects.clear(); }
+
+    bool empty() const { return rects.empty(); }
+    const std::vector<ImageRect>& rectangles() const { return rects; }
+    ImageRect bounds() const;
+    long long area() const;  // pixels covered
+
+    // the rows some rectangle touches, top to bottom, merged where they meet
+    std::vector<RowRange> rows() const;
+};
+
+#endif
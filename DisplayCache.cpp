@@ -0,0 +1,229 @@
+/*
+  incremental redisplay, see DisplayCache.h.
+
+  an image that fits the window is sent as it is, so only its dirty rows go
+  again. one that doesn't is shown through a bilinear copy of the window's
+  size, and every pixel of the copy can depend on any changed pixel's
+  neighbourhood, so the copy is made again and sent whole whenever anything
+  changed. exposes and redraws with nothing dirty send nothing either way.
+
+  an indexed image is treated as dirty all over when the texture is made and
+  clean otherwise. its scaled copy needs the whole image expanded for a
+  moment, only the window sized result is kept
+*/
+
+#include "DisplayCache.h"
+#include "RowSpan.h"
+#include <string.h>
+#include <algorithm>
+
+DisplayCache::DisplayCache() :
+scaling(false), image(nullptr), indexed(nullptr), textureWidth(0), textureHeight(0)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+std::vector<RowRange> DisplayCache::update(Image &image, int windowWidth, int windowHeight, bool &reallocate) {
+    this->image = &image;
+    indexed = nullptr;
+    return refresh(image.takeDirty(), windowWidth, windowHeight, reallocate);
+}
+
+std::vector<RowRange> DisplayCache::update(const IndexedImage &image, int windowWidth, int windowHeight,
+                                           bool &reallocate) {
+    this->image = nullptr;
+    indexed = &image;
+    return refresh(DirtyRegion(), windowWidth, windowHeight, reallocate);
+}
+
+std::vector<RowRange> DisplayCache::refresh(const DirtyRegion &changed, int windowWidth, int windowHeight,
+                                            bool &reallocate) {
+
+    std::vector<RowRange> rows;
+    stats.redraws++;
+
+    int imageWidth = image ? image->getWidth() : indexed->getWidth();
+    int imageHeight = image ? image->getHeight() : indexed->getHeight();
+
+    reallocate = false;
+    if (imageWidth == 0 || imageHeight == 0 || windowWidth <= 0 || windowHeight <= 0)
+        return rows;
+
+    // growing is left to the texture's magnification, shrinking gets a filtered copy
+    bool shrink = windowWidth < imageWidth || windowHeight < imageHeight;
+    int width = shrink ? windowWidth : imageWidth;
+    int height = shrink ? windowHeight : imageHeight;
+
+    reallocate = width != textureWidth || height != textureHeight || shrink != scaling;
+    textureWidth = width;
+    textureHeight = height;
+    scaling = shrink;
+
+    if (reallocate || (shrink && !changed.empty())) {
+        if (shrink && image)
+            scaled = image->resize(width, height, RESIZE_BILINEAR);
+        else if (shrink)
+            scaled = indexed->toImage().resize(width, height, RESIZE_BILINEAR);
+        else
+            scaled = Image();
+        RowRange all = { 0, height };
+        rows.push_back(all);
+    }
+    else
+        rows = changed.rows();
+
+    long long rowBytes = 4 * (long long)width;
+    long long sent = 0;
+    for (size_t i = 0; i < rows.size(); ++i)
+        sent += rowBytes * (rows[i].last - rows[i].first);
+
+    if (sent == 0)
+        stats.cleanRedraws++;
+    else if (sent == rowBytes * height)
+        stats.fullUploads++;
+    else
+        stats.partialUploads++;
+    stats.bytesUploaded += sent;
+    stats.bytesSkipped += rowBytes * height - sent;
+
+    return rows;
+}
+
+const unsigned char* DisplayCache::pixels(int first, int last) {
+
+    if (scaling)
+        return scaled.row(first);
+    if (image)
+        return image->row(first);
+
+    expanded.resize(4 * (size_t)textureWidth * (last - first));
+    for (int h = first; h < last; ++h)
+        indexed->expandRow(h, &expanded[4 * (size_t)textureWidth * (h - first)]);
+
+    return expanded.data();
+}
+
+// one line for the check, false when it failed
+static bool expect(std::ostream &out, const char *what, bool passed) {
+    out << "display " << what << ": " << (passed ? "ok" : "failed") << "\n";
+    return passed;
+}
+
+static bool sameRows(const std::vector<RowRange> &rows, int first, int last) {
+    return rows.size() == 1 && rows[0].first == first && rows[0].last == last;
+}
+
+bool displaySelfCheck(std::ostream &out) {
+
+    bool ok = true;
+    bool reallocate;
+
+    // rectangles that overlap become one, ones that only touch don't
+    DirtyRegion region;
+    ImageRect a = { 0, 10, 0, 10 }, b = { 5, 15, 5, 15 }, c = { 15, 20, 0, 5 };
+    region.add(a);
+    region.add(b);
+    region.add(c);
+    std::vector<RowRange> regionRows = region.rows();
+    ok = expect(out, "region merging", region.rectangles().size() == 2 && region.area() == 225 + 25 &&
+                sameRows(regionRows, 0, 15)) && ok;
+
+    Image image(64, 48, 4);
+    forEachRow(image, [](const RowSpan &row) {
+        for (int x = 0; x < row.width; ++x)
+            row.set(x, pixel(x * 4, row.y * 5, x ^ row.y, 255));
+    });
+
+    DisplayCache cache;
+    size_t full = 64 * 48 * 4;
+
+    // a new image is sent whole, the redraw after that sends nothing
+    std::vector<RowRange> rows = cache.update(image, 100, 100, reallocate);
+    ok = expect(out, "first upload", reallocate && sameRows(rows, 0, 48) &&
+                cache.getStats().bytesUploaded == (long long)full) && ok;
+
+    rows = cache.update(image, 100, 100, reallocate);
+    ok = expect(out, "expose", !reallocate && rows.empty() && cache.getStats().cleanRedraws == 1) && ok;
+
+    // an operation on a region sends the rows of that region, and leaves the rest alone
+    Image before = image.clone();
+    ImageRect roi = { 8, 40, 10, 20 };
+    image.inverse(roi);
+
+    bool outsideKept = true, insideChanged = true;
+    for (int y = 0; y < 48; ++y) {
+        for (int x = 0; x < 64; ++x) {
+            bool inside = x >= roi.x0 && x < roi.x1 && y >= roi.y0 && y < roi.y1;
+            pixel p = image.pixelAt(x, y), q = before.pixelAt(x, y);
+            if (inside)
+                insideChanged = insideChanged && p.r == 255 - q.r && p.a == q.a;
+            else
+                outsideKept = outsideKept && p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+        }
+    }
+    ok = expect(out, "roi operation", outsideKept && insideChanged) && ok;
+
+    rows = cache.update(image, 100, 100, reallocate);
+    ok = expect(out, "partial upload", !reallocate && sameRows(rows, 10, 20) &&
+                cache.getStats().partialUploads == 1 &&
+                cache.getStats().bytesUploaded == (long long)(full + 64 * 10 * 4)) && ok;
+
+    // filters mark only their region too
+    ImageRect blurred = { 0, 64, 30, 34 };
+    image.gaussianBlur(1.5f, blurred);
+    rows = cache.update(image, 100, 100, reallocate);
+    ok = expect(out, "roi filter", !reallocate && sameRows(rows, 30, 34)) && ok;
+
+    // a window smaller than the image shows a scaled copy, sent whole when anything changed
+    rows = cache.update(image, 32, 24, reallocate);
+    ok = expect(out, "scaled upload", reallocate && sameRows(rows, 0, 24) &&
+                cache.getTextureWidth() == 32 && cache.getTextureHeight() == 24 &&
+                cache.pixels(0, 24) != image.row(0)) && ok;
+
+    rows = cache.update(image, 32, 24, reallocate);
+    ok = expect(out, "scaled expose", !reallocate && rows.empty()) && ok;
+
+    image.setPixelAt(3, 3, pixel(1, 2, 3, 4));
+    rows = cache.update(image, 32, 24, reallocate);
+    ok = expect(out, "scaled edit", !reallocate && sameRows(rows, 0, 24)) && ok;
+
+    const DisplayStats &stats = cache.getStats();
+    ok = expect(out, "counters", stats.redraws == 7 &&
+                stats.bytesUploaded + stats.bytesSkipped ==
+                (long long)(4 * full + 3 * 32 * 24 * 4)) && ok;
+
+    // an indexed image is sent when the texture is made or invalidated, its
+    // rows expanded a band at a time
+    std::vector<pixel> palette;
+    palette.push_back(pixel(0, 0, 0, 255));
+    palette.push_back(pixel(255, 0, 0, 128));
+    palette.push_back(pixel(0, 255, 0, 255));
+    IndexedImage indexed(64, 200, palette);
+    for (int h = 0; h < 200; ++h)
+        for (int w = 0; w < 64; ++w)
+            indexed.setIndex(h, w, (w * h) % 3);
+    Image expanded = indexed.toImage();
+
+    DisplayCache indexedCache;
+    rows = indexedCache.update(indexed, 100, 300, reallocate);
+    bool same = reallocate && sameRows(rows, 0, 200);
+    for (int first = 0; first < 200; first += DISPLAY_BAND_ROWS) {
+        int last = std::min(first + DISPLAY_BAND_ROWS, 200);
+        same = same && memcmp(indexedCache.pixels(first, last), expanded.row(first), 4 * 64 * (last - first)) == 0;
+    }
+    ok = expect(out, "indexed upload", same) && ok;
+
+    rows = indexedCache.update(indexed, 100, 300, reallocate);
+    ok = expect(out, "indexed expose", !reallocate && rows.empty()) && ok;
+
+    indexedCache.invalidate();
+    rows = indexedCache.update(indexed, 32, 100, reallocate);
+    ok = expect(out, "indexed scaled", reallocate && sameRows(rows, 0, 100) &&
+                memcmp(indexedCache.pixels(0, 100), expanded.resize(32, 100, RESIZE_BILINEAR).row(0),
+                       4 * 32 * 100) == 0) && ok;
+
+    out << "display: " << stats.bytesUploaded << " bytes uploaded, "
+        << stats.bytesSkipped << " skipped over " << stats.redraws << " redraws\n";
+
+    return ok;
+}
@@ -0,0 +1,80 @@
+// Header file for keeping the display's copy of an image up to date.
+// the window shows the image through a texture, and sending all of it over on
+// every redraw is most of what a redraw costs on a big image. a DisplayCache
+// takes the image's dirty region on each redraw and works out the rows that
+// have to be sent again, nothing at all when the window was just exposed.
+// it doesn't call GL itself(the driver does the uploads), so the bookkeeping
+// can be checked without a window, see displaySelfCheck().
+// a palette indexed image can be shown too, without ever holding all of it as
+// RGBA: its rows are expanded a band at a time as they are sent
+
+#ifndef DISPLAY_CACHE_H
+#define DISPLAY_CACHE_H
+
+#include "Image.h"
+#include "IndexedImage.h"
+#include <vector>
+#include <ostream>
+
+#define DISPLAY_BAND_ROWS 64  // rows asked of pixels() at a time
+
+// counted since the cache was made
+struct DisplayStats {
+    long long redraws;         // calls to update()
+    long long fullUploads;     // the whole texture sent
+    long long partialUploads;  // only some of its rows sent
+    long long cleanRedraws;    // nothing sent
+    long long bytesUploaded;
+    long long bytesSkipped;    // what sending everything every time would have added
+};
+
+class DisplayCache {
+private:
+    // a window sized copy of the image, when the image doesn't fit the window
+    Image scaled;
+    bool scaling;
+
+    // what the last update was given, one or the other
+    Image *image;
+    const IndexedImage *indexed;
+    std::vector<unsigned char> expanded;  // rows of indexed, see pixels()
+
+    int textureWidth, textureHeight;  // 0 till the first update
+    DisplayStats stats;
+
+    std::vector<RowRange> refresh(const DirtyRegion &changed, int windowWidth, int windowHeight,
+                                  bool &reallocate);
+public:
+    DisplayCache();
+
+    // the rows of the texture to send for drawing the image in a window of the
+    // given size, and the image's dirty region is taken. reallocate says the
+    // texture has to be made again at getTextureWidth() x getTextureHeight()
+    // first, all the rows are returned then
+    std::vector<RowRange> update(Image &image, int windowWidth, int windowHeight, bool &reallocate);
+
+    // the same for a palette indexed image. it has no dirty region, so only a
+    // new texture gets it sent: call invalidate() whenever it changes
+    std::vector<RowRange> update(const IndexedImage &image, int windowWidth, int windowHeight,
+                                 bool &reallocate);
+
+    // the RGBA bytes of texture rows [first, last) of the last update, the
+    // image's own or its scaled copy's. an indexed image's are expanded into a
+    // buffer the next call reuses, no more than DISPLAY_BAND_ROWS at a time
+    const unsigned char* pixels(int first, int last);
+
+    int getTextureWidth() const { return textureWidth; }
+    int getTextureHeight() const { return textureHeight; }
+
+    // forget the texture, the next update sends everything
+    void invalidate() { textureWidth = textureHeight = 0; }
+
+    const DisplayStats& getStats() const { return stats; }
+};
+
+// run the dirty tracking and the cache through a series of edits and redraws
+// without a window, reports on the given stream and returns true when every
+// redraw sent what it should have
+bool displaySelfCheck(std::ostream &out);
+
+#endif
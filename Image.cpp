@@ -1,4 +1,6 @@
 #include "Image.h"
+#include "RowSpan.h"
+#include "Kernels.h"
 #include <string.h>
 #include <iostream>
 #include <stdio.h>
@@ -6,53 +8,81 @@
 #include <unordered_set>
 #include <cinttypes>
 #include <limits>
+#include <cmath>
 
 typedef unsigned char uchar;
-typedef std::int16_t int16;
 
 Image::Image(int width, int height, int channels) :
-width(width), height(height), channels(channels)
+width(width), height(height), channels(channels),
+buffer(4 * (size_t)width * height)  // always use 4 channels
 {
-    int numbytes = 4 * width * height;  // always use 4 channels
-    // allocate space for the pixmap
-    pixmap = new unsigned char[numbytes];
+    pixmap = buffer.data();
+    markDirty();
+}
+
+Image::Image(int width, int height, int channels, PixelBuffer &&pixels) :
+width(width), height(height), channels(channels), buffer(std::move(pixels))
+{
+    pixmap = buffer.data();
+    markDirty();
+}
+
+Image::Image(Image &&other) noexcept :
+width(other.width), height(other.height), channels(other.channels),
+buffer(std::move(other.buffer)), pixmap(other.pixmap), dirty(std::move(other.dirty))
+{
+    other.width = other.height = other.channels = 0;
+    other.pixmap = nullptr;
+    other.dirty.clear();
+}
+
+Image& Image::operator=(Image &&other) noexcept {
+
+    if (this != &other) {
+        width = other.width;
+        height = other.height;
+        channels = other.channels;
+        buffer = std::move(other.buffer);
+        pixmap = other.pixmap;
+        dirty = std::move(other.dirty);
+
+        // leave the other image empty
+        other.width = other.height = other.channels = 0;
+        other.pixmap = nullptr;
+        other.dirty.clear();
+    }
+
+    return *this;
+}
+
+Image Image::clone() {
+
+    Image copy(width, height, channels);
+    memcpy(copy.pixmap, pixmap, 4 * (size_t)width * height);
 
-    // setup the matrix access as well
-    matrix = new unsigned char *[height];
-    // set all the pointers appropriately
-    matrix[0] = pixmap;
-    for (int i = 1; i < height; ++i)
-        matrix[i] = matrix[i - 1] + 4 * width;
+    return copy;
 }
 
 // convert the input image to RGBA format if required
 void Image::copyImage(const unsigned char *pixmap_) {
-    // get the number of bytes to copy
-    int numbytes = channels * width * height;
-
-    if (channels == 1) {
-        // greyscale image
-        for (int i = 0, j = 0; i < numbytes; ++i, j += 4) {
-            pixmap[j] = pixmap_[i];
-            pixmap[j+1] = pixmap_[i];
-            pixmap[j+2] = pixmap_[i];
-            pixmap[j+3] = 255;
-        }
+    // get the number of pixels to copy
+    size_t numpixels = (size_t)width * height;
+
+    if (channels == 1)
+        kernels().expandGrey(pixmap_, pixmap, numpixels);  // greyscale image
+    else if (channels == 2)
+        kernels().expandGreyAlpha(pixmap_, pixmap, numpixels);  // greyscale image with alpha
+    else if (channels == 3)
+        kernels().expandRGB(pixmap_, pixmap, numpixels);   // RGB image
+    else if (channels == 4)
+        memcpy(pixmap, pixmap_, 4 * numpixels);  // vanilla RGBA image, no need to do anything
+    else {
+        // extra channels past alpha(depth, masks and the like) are dropped
+        for (size_t i = 0; i < numpixels; ++i)
+            memcpy(pixmap + 4 * i, pixmap_ + channels * i, 4);
     }
-    else if (channels == 3) {
-        // RGB image
-        int alphas = 0;  // the number of alphas we have seen till now
-        for (int i = 0; i < numbytes; ++i) {
-            if ((i + alphas) % 4 == 3) {
-                // we've seen an alpha
-                pixmap[i + alphas] = 255;
-                alphas++;
-            }
-            pixmap[i + alphas] = pixmap_[i];
-        }
-    }
-    else
-        memcpy(pixmap, pixmap_, numbytes);  // vanilla RGBA image, no need to do anything
+
+    markDirty();
 }
 
 /*
@@ -66,56 +96,71 @@ void Image::copyImage(const unsigned char *pixmap_) {
   similarly, we can do the same thing for the green and blue color channels as well
 */
 
-void Image::greyscaleRed() {
+// identity tables for the point operations to start from
+static void identityLut(unsigned char lut[3][256]) {
+    for (int c = 0; c < 3; ++c)
+        for (int v = 0; v < 256; ++v)
+            lut[c][v] = v;
+}
 
-    // set all the b and g to red
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            pixel pix = getpixel(h, w);
-            pix.b = pix.g = pix.r;
-            setpixel(h, w, pix);
-        }
-    }
+// run a point operation over the region, a single kernel call when it is
+// whole rows(which are contiguous)
+void Image::applyLut(const ImageRect &roi, const int source[3], const unsigned char lut[3][256]) {
+
+    ImageRect area = intersect(roi, getBounds());
+    if (area.empty())
+        return;
+
+    if (area.x0 == 0 && area.x1 == width)
+        kernels().applyLut(row(area.y0), (size_t)width * (area.y1 - area.y0), source, lut);
+    else
+        forEachRow(*this, area, [&](const RowSpan &span) {
+            kernels().applyLut(span.data, span.width, source, lut);
+        });
+
+    markDirty(area);
 }
 
-void Image::greyscaleGreen() {
+// copy the given channel into all three
+static void greyscaleLut(int channel, int source[3], unsigned char lut[3][256]) {
+    source[0] = source[1] = source[2] = channel;
+    identityLut(lut);
+}
 
-    // set all the r and b to green
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            pixel pix = getpixel(h, w);
-            pix.r = pix.b = pix.g;
-            setpixel(h, w, pix);
-        }
-    }
+void Image::greyscaleRed(const ImageRect &roi) {
+    // set all the b and g to red
+    int source[3];
+    unsigned char lut[3][256];
+    greyscaleLut(0, source, lut);
+    applyLut(roi, source, lut);
 }
 
-void Image::greyscaleBlue() {
+void Image::greyscaleGreen(const ImageRect &roi) {
+    // set all the r and b to green
+    int source[3];
+    unsigned char lut[3][256];
+    greyscaleLut(1, source, lut);
+    applyLut(roi, source, lut);
+}
 
+void Image::greyscaleBlue(const ImageRect &roi) {
     // set the r and g to blue
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            pixel pix = getpixel(h, w);
-            pix.r = pix.g = pix.b;
-            setpixel(h, w, pix);
-        }
-    }
+    int source[3];
+    unsigned char lut[3][256];
+    greyscaleLut(2, source, lut);
+    applyLut(roi, source, lut);
 }
 
 // flip the image upside down for displaying
-Image* Image::flip() {
+Image Image::flip() {
 
     // flip the image for displaying
-    Image *reversed = new Image(width, height, channels);
+    Image reversed(width, height, channels);
 
     // copy the image row by row, from bottom to top, which ends up
     // flipping it
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            pixel pix = getpixel(height - h - 1, w);
-            reversed->setpixel(h, w, pix);
-        }
-    }
+    for (int h = 0; h < height; ++h)
+        memcpy(reversed.row(h), row(height - h - 1), getStride());
 
     return reversed;
 }
@@ -124,32 +169,29 @@ Image* Image::flip() {
   the classic invert colors operation
   implemented in exactly the same way as was given in the first quiz
 */
-void Image::inverse() {
-
-    // standard inversion operation
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            pixel pix = getpixel(h, w);
-            pix.r = 255 - pix.r;
-            pix.g = 255 - pix.g;
-            pix.b = 255 - pix.b;
-            setpixel(h, w, pix);
-        }
-    }
+void Image::inverse(const ImageRect &roi) {
+
+    // standard inversion operation, as a table lookup
+    int source[3] = { 0, 1, 2 };
+    unsigned char lut[3][256];
+    for (int c = 0; c < 3; ++c)
+        for (int v = 0; v < 256; ++v)
+            lut[c][v] = 255 - v;
+
+    applyLut(roi, source, lut);
 }
 
 // dithering baby, will work only for greyscale images though
-void Image::toBitmap() {
+// the error only travels along the scanline, so any band of rows can be done on its own
+void Image::toBitmap(int firstRow, int lastRow) {
 
-  for (int h = 0; h < height; ++h) {
+  forEachRow(*this, firstRow, lastRow, [](const RowSpan &row) {
 
     int left_error = 0;  // error is 0 at the start of every scanline
 
-    for (int w = 0; w < width; ++w) {
-      // get the current pixel
-      pixel pix = getpixel(h, w);
-
-      int intensity = pix.r;
+    for (unsigned char *p = row.begin(); p != row.end(); p += 4) {
+      // the red channel of the current pixel
+      int intensity = p[0];
       intensity += left_error;
       left_error = intensity;
 
@@ -161,11 +203,13 @@ void Image::toBitmap() {
       else
         intensity = 0;
 
-      pix.r = pix.g = pix.b = intensity;
-      setpixel(h, w, pix);
+      p[0] = p[1] = p[2] = intensity;
     }
 
-  }
+  });
+
+  ImageRect rows = { 0, width, firstRow, lastRow };
+  markDirty(rows);
 
 }
 
@@ -195,74 +239,249 @@ int findClosestPaletteColor(pixel &color,
     return palette_index;
 }
 
-int16 byteCap(int16 num) {
-  if (num > 255) return 255;
-  if (num < 0) return 0;
-
-  return num;
+// floyd-steinberg in action ladies
+void Image::floydSteinberg(std::vector<pixel> &palette, ColorSpace space) {
+  floydSteinberg(palette, space, nullptr);
 }
 
-// floyd-steinberg in action ladies
-void Image::floydSteinberg(std::vector<pixel> &palette) {
+void Image::floydSteinberg(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed) {
 
-  for (int h = 0; h < height-1; ++h) {
-    for (int w = 1; w < width-1; ++w) {
+  if (space != SPACE_SRGB) {
+    floydSteinbergLinear(palette, space, indexed);
+    return;
+  }
 
-      // get the current pixel value from the temp buffer
-      pixel oldpixel = getpixel(h, w);
+  // the palette channel by channel for the distance loop, plus its bytes
+  std::vector<float> c0(palette.size()), c1(palette.size()), c2(palette.size());
+  std::vector<uchar> colors(4 * palette.size());
+  for (size_t i = 0; i < palette.size(); ++i) {
+    c0[i] = palette[i].r;
+    c1[i] = palette[i].g;
+    c2[i] = palette[i].b;
+    colors[4*i] = palette[i].r;
+    colors[4*i + 1] = palette[i].g;
+    colors[4*i + 2] = palette[i].b;
+    colors[4*i + 3] = palette[i].a;
+  }
 
-      pixel newpixel = palette[findClosestPaletteColor(oldpixel, palette)];
+  // every row but the last quantizes its inner pixels and pushes the error
+  // right and down. the border columns and the last row are left as they are,
+  // unless the result is indexed: those pixels get their closest color then,
+  // as that is all an indexed image can hold
+  std::vector<int> matches(width);
+  std::vector<uchar> indices(width);
+  for (int h = 0; h < height; ++h) {
+    if (h + 1 < height)
+      kernels().ditherRow(row(h), row(h + 1), width, colors.data(),
+                          c0.data(), c1.data(), c2.data(), (int)palette.size(), matches.data());
+    if (!indexed)
+      continue;
 
-      setpixel(h, w, newpixel);
+    for (int w = 0; w < width; ++w) {
+      if (h + 1 == height || w == 0 || w == width - 1) {
+        uchar *p = row(h) + 4 * w;
+        pixel color(p[0], p[1], p[2], p[3]);
+        matches[w] = findClosestPaletteColor(color, palette);
+        const pixel &chosen = palette[matches[w]];
+        p[0] = chosen.r;
+        p[1] = chosen.g;
+        p[2] = chosen.b;
+        p[3] = chosen.a;
+      }
+      indices[w] = (uchar)matches[w];
+    }
+    indexed->setRow(h, indices.data());
+  }
 
-      int16 qer = oldpixel.r - newpixel.r;
-      int16 qeg = oldpixel.g - newpixel.g;
-      int16 qeb = oldpixel.b - newpixel.b;
+  markDirty();
 
-      pixel neighbor = getpixel(h, w + 1);
-      neighbor.r = byteCap(neighbor.r + qer * 7/16);
-      neighbor.g = byteCap(neighbor.g + qeg * 7/16);
-      neighbor.b = byteCap(neighbor.b + qeb * 7/16);
-      setpixel(h, w + 1, neighbor);
+}
 
-      neighbor = getpixel(h + 1, w - 1);
-      neighbor.r = byteCap(neighbor.r + qer * 3/16);
-      neighbor.g = byteCap(neighbor.g + qeg * 3/16);
-      neighbor.b = byteCap(neighbor.b + qeb * 3/16);
-      setpixel(h + 1, w - 1, neighbor);
+/*
+  floyd-steinberg with the error kept in linear light, which is where light
+  actually adds up, and the palette matched in the given space.
+  only two rows of error are alive at any time
+*/
+void Image::floydSteinbergLinear(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed) {
 
-      neighbor = getpixel(h + 1, w);
-      neighbor.r = byteCap(neighbor.r + qer * 5/16);
-      neighbor.g = byteCap(neighbor.g + qeg * 5/16);
-      neighbor.b = byteCap(neighbor.b + qeb * 5/16);
-      setpixel(h + 1, w, neighbor);
+  const float *linear = srgbToLinearTable();
+  PaletteMatcher matcher(palette, space);
 
-      neighbor = getpixel(h + 1, w + 1);
-      neighbor.r = byteCap(neighbor.r + qer * 1/16);
-      neighbor.g = byteCap(neighbor.g + qeg * 1/16);
-      neighbor.b = byteCap(neighbor.b + qeb * 1/16);
-      setpixel(h + 1, w + 1, neighbor);
+  // the palette in linear light, to work out the error of each choice
+  std::vector<float> paletteLinear(3 * palette.size());
+  for (size_t i = 0; i < palette.size(); ++i) {
+    paletteLinear[3*i] = linear[palette[i].r];
+    paletteLinear[3*i + 1] = linear[palette[i].g];
+    paletteLinear[3*i + 2] = linear[palette[i].b];
+  }
 
-      // get the neighboring pixels and set their values up accordingly
+  // one spare entry on either side so that the neighbours never need bounds checks
+  std::vector<float> current(3 * (width + 2), 0.0f), next(3 * (width + 2), 0.0f);
+  std::vector<uchar> indices(width);
+
+  forEachRow(*this, [&](const RowSpan &row) {
+    for (int w = 0; w < row.width; ++w) {
+
+      pixel oldpixel = row.get(w);
+      float *error = &current[3 * (w + 1)];
+
+      float rgb[3];
+      rgb[0] = std::min(std::max(linear[oldpixel.r] + error[0], 0.0f), 1.0f);
+      rgb[1] = std::min(std::max(linear[oldpixel.g] + error[1], 0.0f), 1.0f);
+      rgb[2] = std::min(std::max(linear[oldpixel.b] + error[2], 0.0f), 1.0f);
+
+      float color[3];
+      linearToSpace(space, rgb, color);
+      int index = matcher.closest(color);
+      row.set(w, palette[index]);
+      indices[w] = (uchar)index;
+
+      for (int c = 0; c < 3; ++c) {
+        float qe = rgb[c] - paletteLinear[3*index + c];
+        error[3 + c] += qe * 7/16;
+        next[3 * w + c] += qe * 3/16;
+        next[3 * (w + 1) + c] += qe * 5/16;
+        next[3 * (w + 2) + c] += qe * 1/16;
+      }
     }
-  }
+
+    current.swap(next);
+    std::fill(next.begin(), next.end(), 0.0f);
+    if (indexed)
+      indexed->setRow(row.y, indices.data());
+  });
+
+  markDirty();
 
 }
 
 /*
   reduce palette of the image
 */
-void Image::reducePalette(std::vector<pixel> &palette) {
+void Image::reducePalette(std::vector<pixel> &palette, ColorSpace space) {
+  reducePalette(palette, space, nullptr);
+}
 
-  for (int h = 0; h < height; ++h) {
-    for (int w = 0; w < width; ++w) {
-      // find the closest color and set the pixel accordingly
-      pixel current_pixel = getpixel(h, w);
-      int palette_index = findClosestPaletteColor(current_pixel, palette);
-      setpixel(h, w, palette[palette_index]);
+void Image::reducePalette(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed) {
+
+  // the palette gets converted into the matching space just once, for sRGB
+  // this picks the same colors as findClosestPaletteColor
+  PaletteMatcher matcher(palette, space);
+  std::vector<float> points(3 * width);
+  std::vector<int> indices(width);
+  std::vector<uchar> packed(width);
+
+  forEachRow(*this, [&](const RowSpan &row) {
+    // match a whole scanline at once and set the pixels accordingly
+    matcher.toSpace(row.data, row.width, points.data());
+    matcher.closest(points.data(), row.width, indices.data());
+    for (int w = 0; w < row.width; ++w) {
+      row.set(w, palette[indices[w]]);
+      packed[w] = (uchar)indices[w];
     }
+    if (indexed)
+      indexed->setRow(row.y, packed.data());
+  });
+
+  markDirty();
+
+}
+
+// quantize the image into palette indices without touching the pixels
+IndexedImage Image::toIndexed(std::vector<pixel> &palette, ColorSpace space) {
+
+  if (palette.empty() || palette.size() > 256)
+    return IndexedImage();
+
+  IndexedImage indexed(width, height, palette);
+  PaletteMatcher matcher(palette, space);
+  std::vector<float> points(3 * width);
+  std::vector<int> matches(width);
+  std::vector<unsigned char> indices(width);
+
+  forEachRow(*this, [&](const RowSpan &row) {
+    matcher.toSpace(row.data, row.width, points.data());
+    matcher.closest(points.data(), row.width, matches.data());
+    for (int w = 0; w < row.width; ++w)
+      indices[w] = (uchar)matches[w];
+    indexed.setRow(row.y, indices.data());
+  });
+
+  return indexed;
+}
+
+// the operation runs either way, the indices only for palettes that fit
+static bool indexable(const std::vector<pixel> &palette) {
+  return !palette.empty() && palette.size() <= 256;
+}
+
+IndexedImage Image::reducePaletteIndexed(std::vector<pixel> &palette, ColorSpace space) {
+
+  if (!indexable(palette)) {
+    reducePalette(palette, space);
+    return IndexedImage();
+  }
+
+  IndexedImage indexed(width, height, palette);
+  reducePalette(palette, space, &indexed);
+  return indexed;
+}
+
+IndexedImage Image::floydSteinbergIndexed(std::vector<pixel> &palette, ColorSpace space) {
+
+  if (!indexable(palette)) {
+    floydSteinberg(palette, space);
+    return IndexedImage();
   }
 
+  IndexedImage indexed(width, height, palette);
+  floydSteinberg(palette, space, &indexed);
+  return indexed;
+}
+
+IndexedImage Image::toBitmapIndexed() {
+  toBitmap();
+  return indexBitmap();
+}
+
+IndexedImage Image::indexBitmap() {
+
+  // palette index of every (white, alpha) pair, opaque black and white first
+  // so that an opaque bitmap stays 1 bit
+  std::vector<int> slots(512, -1);
+  std::vector<pixel> palette;
+  palette.push_back(pixel(0, 0, 0, 255));
+  palette.push_back(pixel(255, 255, 255, 255));
+  slots[255] = 0;
+  slots[256 + 255] = 1;
+
+  bool fits = true;
+  forEachPixel(*this, [&](const pixel &color) {
+    int key = (color.r >= 128) * 256 + color.a;
+    if (slots[key] >= 0 || !fits)
+      return;
+    if (palette.size() == 256) {
+      fits = false;
+      return;
+    }
+    slots[key] = (int)palette.size();
+    uchar value = color.r >= 128 ? 255 : 0;
+    palette.push_back(pixel(value, value, value, color.a));
+  });
+  if (!fits)
+    return IndexedImage();
+
+  IndexedImage indexed(width, height, palette);
+  std::vector<unsigned char> indices(width);
+  forEachRow(*this, [&](const RowSpan &row) {
+    for (int w = 0; w < row.width; ++w) {
+      const unsigned char *p = row.at(w);
+      indices[w] = (uchar)slots[(p[0] >= 128) * 256 + p[3]];
+    }
+    indexed.setRow(row.y, indices.data());
+  });
+
+  return indexed;
 }
 
 // root mean square of all pixel values in the given range
@@ -387,26 +606,64 @@ void medianCut(std::vector<pixel> &pixels, std::vector<pixel> &palette) {
 	medianCutUtil(pixels, palette, 0, pixels.size() - 1, paletteIndex, (size_t)log2((double)length));
 }
 
-// reduce the number of colors in the image by applying the median cut algorithm
-void Image::getReducedPalette(std::vector<pixel> &palette) {
+// a color converted into the space that median cut is running in
+struct SpacePoint {
+	float c[3];
+};
 
-  std::unordered_set<pixel, HashColor> unique; // store all the unique pixel values
+// same as medianCutUtil, but on colors in a perceptual space. the buckets
+// are represented by their mean, which is meaningful in these spaces
+void medianCutSpaceUtil(std::vector<SpacePoint> &points, std::vector<pixel> &palette,
+				   size_t start, size_t end, size_t &paletteIndex, size_t length, ColorSpace space) {
 
-  // iterate over every pixel and add it to the set if it doesn't already exist
-  for (int h = 0; h < height; ++h) {
-    for (int w = 0; w < width; ++w) {
-      // get the current pixel
-      pixel current = getpixel(h, w);
+	if (length == 0) {
+		double sum[3] = { 0, 0, 0 };
+		for (size_t i = start; i <= end; ++i)
+			for (int c = 0; c < 3; ++c)
+				sum[c] += points[i].c[c];
 
-      // std::cout << "(" << (int)current.r << ", " << (int)current.g << ", " << (int)current.b << ")\n";
+		float mean[3];
+		for (int c = 0; c < 3; ++c)
+			mean[c] = (float)(sum[c] / (double)(end - start + 1));
 
-  		if (unique.find(current) == unique.end()) {
-  			// the element does not exist, add it
-  			unique.insert(current);
-  		}
+		palette[paletteIndex++] = spaceToSrgb(space, mean);
+		return;
+	}
 
-    }
-  }
+	// split along the axis with the biggest range
+	float lo[3], hi[3];
+	for (int c = 0; c < 3; ++c)
+		lo[c] = hi[c] = points[start].c[c];
+	for (size_t i = start + 1; i <= end; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			lo[c] = std::min(lo[c], points[i].c[c]);
+			hi[c] = std::max(hi[c], points[i].c[c]);
+		}
+	}
+
+	int axis = 0;
+	for (int c = 1; c < 3; ++c)
+		if (hi[c] - lo[c] > hi[axis] - lo[axis])
+			axis = c;
+
+	std::sort(points.begin() + start, points.begin() + end + 1,
+			  [axis](const SpacePoint &a, const SpacePoint &b) { return a.c[axis] < b.c[axis]; });
+
+	size_t mid = (start + end) / 2;
+
+	medianCutSpaceUtil(points, palette, start, mid, paletteIndex, length - 1, space);
+	medianCutSpaceUtil(points, palette, mid + 1, end, paletteIndex, length - 1, space);
+}
+
+// reduce the number of colors in the image by applying the median cut algorithm
+void Image::getReducedPalette(std::vector<pixel> &palette, ColorSpace space) {
+
+  std::unordered_set<pixel, HashColor> unique; // store all the unique pixel values
+
+  // iterate over every pixel and add it to the set if it doesn't already exist
+  forEachPixel(*this, [&unique](const pixel &current) {
+    unique.insert(current);
+  });
 
   std::vector<pixel> unique_pixels;  // vector containing all the unique pixels
 
@@ -421,6 +678,27 @@ void Image::getReducedPalette(std::vector<pixel> &palette) {
 
   std::cout << "# of colors in the original image: " << unique_pixels.size() << "\n";
 
+  // median cut needs more colors than palette entries to split, otherwise the
+  // colors themselves are the palette(the last one repeated to fill it)
+  if (unique_pixels.empty())
+    return;
+  if (unique_pixels.size() <= palette.size()) {
+    for (size_t i = 0; i < palette.size(); ++i)
+      palette[i] = unique_pixels[std::min(i, unique_pixels.size() - 1)];
+    return;
+  }
+
   // let the median cut algorithm begin
-  medianCut(unique_pixels, palette);
+  if (space == SPACE_SRGB) {
+    medianCut(unique_pixels, palette);
+    return;
+  }
+
+  std::vector<SpacePoint> points(unique_pixels.size());
+  for (size_t i = 0; i < unique_pixels.size(); ++i)
+    srgbToSpace(space, unique_pixels[i].r, unique_pixels[i].g, unique_pixels[i].b, points[i].c);
+
+  size_t paletteIndex = 0;
+  medianCutSpaceUtil(points, palette, 0, points.size() - 1, paletteIndex,
+                     (size_t)log2((double)palette.size()), space);
 }
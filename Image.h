@@ -6,66 +6,184 @@
 #define IMAGE_H
 
 #include "pixel.h"
+#include "PixelAllocator.h"
+#include "ColorSpace.h"
+#include "IndexedImage.h"
+#include "DirtyRegion.h"
 #include <vector>
+#include <utility>
+#include <ostream>
+
+// the filters resize can use, from fastest to sharpest. all but nearest
+// average over every covered pixel when shrinking
+enum ResizeFilter { RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_BICUBIC, RESIZE_LANCZOS3 };
+
+struct RowSpan;  // RowSpan.h
 
 class Image {
-        // model standard image attributes like specs(dimensions, no of channels),
-        // the actual image data and the matrix like interface which holds pointers
-        // to each and every scanline of the raster image
+        // model standard image attributes like specs(dimensions, no of channels)
+        // and the actual image data, RGBA rows one right after the other
 private:
         int width, height, channels;
+        PixelBuffer buffer;  // owns the pixels, 64 byte aligned and recycled through the pool
         unsigned char *pixmap;
-        unsigned char **matrix;  // access in true matrix style
+        DirtyRegion dirty;   // changed since the last takeDirty()
 public:
+        Image() : width(0), height(0), channels(0), pixmap(nullptr) {}
         Image(int width, int height, int channels);
+        // an image on pixels that are already there(at least 4 * width * height
+        // bytes of RGBA), e.g. a mapping of the raw pixel cache
+        Image(int width, int height, int channels, PixelBuffer &&pixels);
+
+        // images own their pixels, so they can be moved around but copying has
+        // to be asked for explicitly through clone()
+        Image(Image &&other) noexcept;
+        Image& operator=(Image &&other) noexcept;
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        Image clone();  // deep copy
 
-        // call to clean up
-        void destroy() {
-            delete[] matrix;
-            delete[] pixmap;
-        }
         void copyImage(const unsigned char *pixmap_);
         // define some getters
         int getWidth()       { return width; }
         int getHeight()      { return height; }
+        int getChannels()    { return channels; }  // of the file it was read from
         unsigned char* getPixmap() { return pixmap; }
+        size_t getStride()   { return 4 * (size_t)width; }  // bytes per row
 
-        // routines to get and set pixel values at the given pixel location(x, y)
-        pixel getpixel(int x, int y) {
-            unsigned char red = matrix[x][4*y];
-            unsigned char green = matrix[x][4*y + 1];
-            unsigned char blue = matrix[x][4*y + 2];
-            unsigned char alpha = matrix[x][4*y + 3];
+        // scanline y, as bytes or as a span to loop over(see RowSpan.h, which
+        // also has the templates that the operations use to walk the image)
+        unsigned char* row(int y) { return pixmap + getStride() * y; }
+        RowSpan rowSpan(int y);
 
-            return pixel(red, green, blue, alpha);
+        // routines to get and set the pixel in column x of row y(the old
+        // getpixel/setpixel took the row first). loops over the whole image are
+        // better off with the row spans
+        pixel pixelAt(int x, int y) {
+            const unsigned char *p = row(y) + 4 * (size_t)x;
+            return pixel(p[0], p[1], p[2], p[3]);
         }
 
-        void setpixel(int x, int y, pixel pix) {
-            matrix[x][4*y] = pix.r;
-            matrix[x][4*y + 1] = pix.g;
-            matrix[x][4*y + 2] = pix.b;
-            matrix[x][4*y + 3] = pix.a;
+        void setPixelAt(int x, int y, pixel pix) {
+            unsigned char *p = row(y) + 4 * (size_t)x;
+            p[0] = pix.r;
+            p[1] = pix.g;
+            p[2] = pix.b;
+            p[3] = pix.a;
+            ImageRect written = { x, x + 1, y, y + 1 };
+            markDirty(written);
         }
 
-        void inverse();
+        // the parts of the image that changed since the last takeDirty(), for
+        // whoever keeps a copy of the pixels(the display). a new image is
+        // dirty all over, and every operation marks what it writes. code that
+        // writes through getPixmap() or row() has to mark what it wrote itself
+        ImageRect getBounds() {
+            ImageRect all = { 0, width, 0, height };
+            return all;
+        }
+        void markDirty() { markDirty(getBounds()); }
+        void markDirty(const ImageRect &rect) { dirty.add(intersect(rect, getBounds())); }
+        const DirtyRegion& getDirty() { return dirty; }
+        DirtyRegion takeDirty() {
+            DirtyRegion taken;
+            std::swap(taken, dirty);
+            return taken;
+        }
+
+        // the point operations and the spatial filters also come limited to a
+        // region of interest, which is all they read or write(the filters
+        // still look at the pixels around it)
+        void inverse() { inverse(getBounds()); }
+        void inverse(const ImageRect &roi);
 
         // reverse the image for display purposes, returns a new image
-        Image* flip();
+        Image flip();
 
         // greyscale operations
-        void greyscaleRed();
-        void greyscaleGreen();
-        void greyscaleBlue();
+        void greyscaleRed()   { greyscaleRed(getBounds()); }
+        void greyscaleGreen() { greyscaleGreen(getBounds()); }
+        void greyscaleBlue()  { greyscaleBlue(getBounds()); }
+        void greyscaleRed(const ImageRect &roi);
+        void greyscaleGreen(const ImageRect &roi);
+        void greyscaleBlue(const ImageRect &roi);
 
-        void toBitmap();
-        void reducePalette(std::vector<pixel> &palette);
+        void toBitmap() { toBitmap(0, height); }
+        void toBitmap(int firstRow, int lastRow);  // rows [firstRow, lastRow) only
+        // the palette operations can measure color distances in a perceptual
+        // space instead of raw sRGB, see ColorSpace.h
+        void reducePalette(std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
 
         // using median cut for automatic palette generation
-        void getReducedPalette(std::vector<pixel> &palette);  // the results will be populated
-        // into the palette
+        void getReducedPalette(std::vector<pixel> &palette,  // the results will be populated
+                               ColorSpace space = SPACE_SRGB);  // into the palette
+
+        // floyd steinberg dithering, error is diffused in linear light for
+        // anything but SPACE_SRGB
+        void floydSteinberg(std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
 
-        // floyd steinberg dithering
-        void floydSteinberg(std::vector<pixel> &palette);
+        // palette indexed results(palettes of up to 256 colors). toIndexed leaves
+        // the image alone, the others apply the operation to the image and
+        // record each pixel's index as it gets quantized
+        IndexedImage toIndexed(std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
+        IndexedImage reducePaletteIndexed(std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
+        IndexedImage floydSteinbergIndexed(std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
+        IndexedImage toBitmapIndexed();  // 1 bit, black and white
+
+        // index an image toBitmap has run on, with a palette entry for each
+        // alpha black or white pixels have(empty when that's more than 256)
+        IndexedImage indexBitmap();
+
+        // spatial filters(Convolution.cpp). they work on cache sized tiles
+        // spread over all the cores. alpha is filtered along with the colors
+        // by kernels that add up to one(the blurs) and left alone otherwise
+        void gaussianBlur(float sigma) { gaussianBlur(sigma, getBounds()); }
+        void gaussianBlur(float sigma, const ImageRect &roi);
+        void boxBlur(int radius) { boxBlur(radius, getBounds()); }
+        void boxBlur(int radius, const ImageRect &roi);
+        // push colors away from their gaussian blur by amount(1 doubles the
+        // difference), leaving differences below threshold alone
+        void unsharpMask(float sigma, float amount, int threshold = 0) {
+            unsharpMask(sigma, amount, threshold, getBounds());
+        }
+        void unsharpMask(float sigma, float amount, int threshold, const ImageRect &roi);
+        // any size x size kernel, row major. kernels that are an outer
+        // product of two vectors get the separable path. returns false when
+        // the kernel is too strong for the fixed point engine(its absolute
+        // weights summing to 64 or more, or to 8 or more along one row, or
+        // along either vector of a separable one)
+        bool convolve(const std::vector<float> &kernel, int size) {
+            return convolve(kernel, size, getBounds());
+        }
+        bool convolve(const std::vector<float> &kernel, int size, const ImageRect &roi);
+        bool convolveSeparable(const std::vector<float> &horizontal, const std::vector<float> &vertical) {
+            return convolveSeparable(horizontal, vertical, getBounds());
+        }
+        bool convolveSeparable(const std::vector<float> &horizontal, const std::vector<float> &vertical,
+                               const ImageRect &roi);
+
+        // resampling(Resize.cpp), both return a new image. resizeToFit keeps
+        // the aspect ratio and only ever shrinks
+        Image resize(int newWidth, int newHeight, ResizeFilter filter = RESIZE_LANCZOS3);
+        Image resizeToFit(int maxWidth, int maxHeight, ResizeFilter filter = RESIZE_LANCZOS3);
+private:
+        // the palette operations, writing the indices to indexed when it isn't null
+        void reducePalette(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed);
+        void floydSteinberg(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed);
+        void floydSteinbergLinear(std::vector<pixel> &palette, ColorSpace space, IndexedImage *indexed);
+        void applyLut(const ImageRect &roi, const int source[3], const unsigned char lut[3][256]);
+        Image separableRegion(const std::vector<float> &horizontal, const std::vector<float> &vertical,
+                              const ImageRect &area);
+        void takeRegion(Image &&filtered, const ImageRect &area);
 };
 
+// index of the palette color closest to the given color
+int findClosestPaletteColor(pixel &color, std::vector<pixel> &palette);
+
+// run the convolution engine on kernels at the edge of what its fixed point
+// weights hold, reports on the given stream and returns true when they came
+// out right
+bool filterSelfCheck(std::ostream &out);
+
 #endif
@@ -0,0 +1,805 @@
+/*
+  reading images from disk and writing them back, either synchronously or
+  through the background writer which lets the caller overlap encoding with
+  more processing
+*/
+
+#include "ImageIO.h"
+#include "RawCache.h"
+#include <OpenImageIO/imageio.h>
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+#include <cinttypes>
+#include <algorithm>
+#include <zlib.h>
+
+OIIO_NAMESPACE_USING
+
+ImageSnapshot::ImageSnapshot(Image &image) :
+width(image.getWidth()), height(image.getHeight())
+{
+    const unsigned char *src = image.getPixmap();
+    pixels.assign(src, src + 4 * (size_t)width * height);
+}
+
+bool readImageFile(const std::string &filename, Image &image) {
+
+    // sources read before are mapped straight from the raw cache
+    SourceIdentity identity;
+    bool cacheable = identifySource(filename, identity);
+    if (cacheable && readRawCache(identity, image))
+        return true;
+
+    ImageInput *input = ImageInput::open(filename);
+    if (!input) {
+        std::cerr << "Could not read image " << filename << ", error = " << geterror() << std::endl;
+        return false;
+    }
+
+    // get the metadata for the image(dimensions and number of channels)
+    const ImageSpec &spec = input->spec();
+    int width = spec.width;
+    int height = spec.height;
+    int channels = spec.nchannels;
+
+    // decode into a pooled buffer, so that reading one image after the other
+    // keeps reusing the same memory
+    PixelBuffer decoded((size_t)channels * width * height);
+
+    if (!input->read_image(TypeDesc::UINT8, decoded.data())) {
+        std::cerr << "Could not read image " << filename << ", error = " << input->geterror() << std::endl;
+        ImageInput::destroy(input);
+        return false;
+    }
+    if (!input->close()) {
+        std::cerr << "Could not close " << filename << ", error = " << input->geterror() << std::endl;
+        ImageInput::destroy(input);
+        return false;
+    }
+    ImageInput::destroy(input);
+
+    image = Image(width, height, channels);
+    image.copyImage(decoded.data());  // expands to RGBA
+
+    if (cacheable)
+        writeRawCache(filename, identity, image);  // best effort, next time is just slower without it
+    return true;
+}
+
+bool probeImageFile(const std::string &filename, int &width, int &height, int &channels) {
+
+    if (probeRawCache(filename, width, height, channels))
+        return true;
+
+    ImageInput *input = ImageInput::open(filename);
+    if (!input) {
+        std::cerr << "Could not read image " << filename << ", error = " << geterror() << std::endl;
+        return false;
+    }
+
+    const ImageSpec &spec = input->spec();
+    width = spec.width;
+    height = spec.height;
+    channels = spec.nchannels;
+
+    input->close();
+    ImageInput::destroy(input);
+    return true;
+}
+
+int essentialChannels(const unsigned char *rgba, size_t npixels) {
+
+    bool color = false;  // some pixel has r, g and b differing
+    bool alpha = false;  // some pixel is not fully opaque
+
+    for (size_t i = 0; i < npixels && !(color && alpha); ++i, rgba += 4) {
+        if (rgba[0] != rgba[1] || rgba[1] != rgba[2])
+            color = true;
+        if (rgba[3] != 255)
+            alpha = true;
+    }
+
+    if (color)
+        return alpha ? 4 : 3;
+    return alpha ? 2 : 1;
+}
+
+// pick the compression attribute for the given format and preset,
+// returns an empty string for formats where we leave the plugin defaults alone
+static std::string compressionFor(const std::string &format, CompressionPreset preset) {
+
+    if (format == "png" || format == "tiff") {
+        if (preset == COMPRESS_FASTEST) return "zip:1";
+        if (preset == COMPRESS_SMALLEST) return "zip:9";
+        return "zip:6";
+    }
+    if (format == "openexr") {
+        if (preset == COMPRESS_FASTEST) return "rle";
+        if (preset == COMPRESS_SMALLEST) return "piz";
+        return "zip";
+    }
+
+    return "";
+}
+
+bool writeImageFile(const std::string &filename, const ImageSnapshot &snapshot,
+                    const WriteOptions &options) {
+
+    int w = snapshot.width;
+    int h = snapshot.height;
+    const unsigned char *rgba = snapshot.pixels.data();
+
+    // create the oiio file handler for the image
+    ImageOutput *outfile = ImageOutput::create(filename);
+    if (!outfile) {
+        std::cerr << "Could not create output image for " << filename << ", error = " << geterror() << std::endl;
+        return false;
+    }
+
+    int channels = 4;
+    if (options.dropRedundantChannels)
+        channels = essentialChannels(rgba, (size_t)w * h);
+
+    // grey and RGB are prefixes of RGBA, so they can be written straight out of the
+    // snapshot by striding over the unused channels. grey + alpha has to be packed
+    std::vector<unsigned char> packed;
+    const unsigned char *data = rgba;
+    stride_t xstride = 4;
+    if (channels == 2) {
+        packed.resize(2 * (size_t)w * h);
+        for (size_t i = 0, n = (size_t)w * h; i < n; ++i) {
+            packed[2*i] = rgba[4*i];
+            packed[2*i + 1] = rgba[4*i + 3];
+        }
+        data = packed.data();
+        xstride = 2;
+    }
+    stride_t ystride = xstride * w;
+
+    ImageSpec spec(w, h, channels, TypeDesc::UINT8);
+    if (channels == 1) {
+        spec.channelnames.assign(1, "Y");
+    }
+    else if (channels == 2) {
+        spec.channelnames.clear();
+        spec.channelnames.push_back("Y");
+        spec.channelnames.push_back("A");
+        spec.alpha_channel = 1;
+    }
+
+    std::string compression = compressionFor(outfile->format_name(), options.compression);
+    if (!compression.empty())
+        spec.attribute("compression", compression);
+
+    // tiled formats get their tiles compressed in parallel by the plugin when
+    // all of them are handed over in a single write_tiles call
+    bool tiled = options.tileSize > 0 && outfile->supports("tiles");
+    if (tiled) {
+        spec.tile_width = spec.tile_height = options.tileSize;
+        spec.tile_depth = 1;
+    }
+    if (options.threads > 0)
+        outfile->threads(options.threads);
+
+    if (!outfile->open(filename, spec)) {
+        std::cerr << "Could not open " << filename << ", error = " << outfile->geterror() << std::endl;
+        ImageOutput::destroy(outfile);
+        return false;
+    }
+
+    bool ok;
+    if (tiled)
+        ok = outfile->write_tiles(0, w, 0, h, 0, 1, TypeDesc::UINT8, data, xstride, ystride);
+    else
+        ok = outfile->write_image(TypeDesc::UINT8, data, xstride, ystride);
+
+    if (!ok) {
+        std::cerr << "Could not write image to " << filename << ", error = " << outfile->geterror() << std::endl;
+        ImageOutput::destroy(outfile);
+        return false;
+    }
+
+    if (!outfile->close()) {
+        std::cerr << "Could not close " << filename << ", error = " << outfile->geterror() << std::endl;
+        ImageOutput::destroy(outfile);
+        return false;
+    }
+
+    ImageOutput::destroy(outfile);
+    return true;
+}
+
+/*
+  paletted writers. OIIO only writes full color channels, so palette indexed
+  images are encoded here directly: PNG through zlib, GIF with its own LZW
+  coder, and the uncompressed BMP and PBM formats by hand
+*/
+
+static void put16LE(std::vector<unsigned char> &out, unsigned int value) {
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+static void put32LE(std::vector<unsigned char> &out, std::uint32_t value) {
+    put16LE(out, value & 0xffff);
+    put16LE(out, value >> 16);
+}
+
+static void put32BE(std::vector<unsigned char> &out, std::uint32_t value) {
+    out.push_back((value >> 24) & 0xff);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back(value & 0xff);
+}
+
+static bool writeBytes(const std::string &filename, const std::vector<unsigned char> &bytes) {
+
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Could not open " << filename << " for writing" << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "Could not write image to " << filename << std::endl;
+
+    return ok;
+}
+
+static void pngChunk(std::vector<unsigned char> &out, const char *type,
+                     const std::vector<unsigned char> &data) {
+
+    put32BE(out, (std::uint32_t)data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+
+    // the crc covers the chunk type and the data
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, &out[start], (uInt)(out.size() - start));
+    put32BE(out, (std::uint32_t)crc);
+}
+
+static bool writePalettedPNG(const std::string &filename, const IndexedImage &image,
+                             const WriteOptions &options) {
+
+    const std::vector<pixel> &palette = image.getPalette();
+    std::vector<unsigned char> out;
+    const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+
+    std::vector<unsigned char> header;
+    put32BE(header, image.getWidth());
+    put32BE(header, image.getHeight());
+    header.push_back(image.getBits());
+    header.push_back(3);  // color type: palette
+    header.push_back(0);  // deflate
+    header.push_back(0);  // adaptive filtering
+    header.push_back(0);  // no interlacing
+    pngChunk(out, "IHDR", header);
+
+    std::vector<unsigned char> colors, alphas;
+    size_t lastTransparent = 0;
+    for (size_t i = 0; i < palette.size(); ++i) {
+        colors.push_back(palette[i].r);
+        colors.push_back(palette[i].g);
+        colors.push_back(palette[i].b);
+        alphas.push_back(palette[i].a);
+        if (palette[i].a != 255)
+            lastTransparent = i + 1;
+    }
+    pngChunk(out, "PLTE", colors);
+    if (lastTransparent > 0) {
+        // only the entries up to the last non opaque one need to be listed
+        alphas.resize(lastTransparent);
+        pngChunk(out, "tRNS", alphas);
+    }
+
+    // every scanline is prefixed by its filter type, 0 = none. filters don't
+    // buy much on packed indices
+    size_t stride = image.getStride();
+    std::vector<unsigned char> raw((stride + 1) * image.getHeight());
+    for (int h = 0; h < image.getHeight(); ++h) {
+        raw[(stride + 1) * h] = 0;
+        memcpy(&raw[(stride + 1) * h + 1], image.row(h), stride);
+    }
+
+    int level = options.compression == COMPRESS_FASTEST ? 1 :
+                options.compression == COMPRESS_SMALLEST ? 9 : 6;
+    uLongf size = compressBound((uLong)raw.size());
+    std::vector<unsigned char> compressed(size);
+    if (compress2(compressed.data(), &size, raw.data(), (uLong)raw.size(), level) != Z_OK) {
+        std::cerr << "Could not compress " << filename << std::endl;
+        return false;
+    }
+    compressed.resize(size);
+    pngChunk(out, "IDAT", compressed);
+    pngChunk(out, "IEND", std::vector<unsigned char>());
+
+    return writeBytes(filename, out);
+}
+
+static bool writePalettedBMP(const std::string &filename, const IndexedImage &image) {
+
+    // BMP has no 2 bit mode, those go out as 4 bits
+    int bits = image.getBits() == 2 ? 4 : image.getBits();
+    int width = image.getWidth();
+    int height = image.getHeight();
+    size_t rowbytes = (((size_t)width * bits + 31) / 32) * 4;  // rows are padded to 4 bytes
+    size_t colors = (size_t)1 << bits;
+    size_t offset = 14 + 40 + 4 * colors;
+
+    std::vector<unsigned char> out;
+    out.push_back('B');
+    out.push_back('M');
+    put32LE(out, (std::uint32_t)(offset + rowbytes * height));
+    put32LE(out, 0);
+    put32LE(out, (std::uint32_t)offset);
+
+    put32LE(out, 40);
+    put32LE(out, width);
+    put32LE(out, height);  // positive height: rows are stored bottom up
+    put16LE(out, 1);
+    put16LE(out, bits);
+    put32LE(out, 0);       // uncompressed
+    put32LE(out, (std::uint32_t)(rowbytes * height));
+    put32LE(out, 2835);    // 72 dpi
+    put32LE(out, 2835);
+    put32LE(out, (std::uint32_t)image.getPalette().size());
+    put32LE(out, 0);
+
+    const std::vector<pixel> &palette = image.getPalette();
+    for (size_t i = 0; i < colors; ++i) {
+        pixel color = i < palette.size() ? palette[i] : pixel(0, 0, 0, 255);
+        out.push_back(color.b);
+        out.push_back(color.g);
+        out.push_back(color.r);
+        out.push_back(0);
+    }
+
+    std::vector<unsigned char> row(rowbytes);
+    for (int h = height - 1; h >= 0; --h) {
+        std::fill(row.begin(), row.end(), 0);
+        if (bits == image.getBits()) {
+            memcpy(row.data(), image.row(h), image.getStride());
+        }
+        else {
+            for (int w = 0; w < width; ++w)
+                row[w / 2] |= image.getIndex(h, w) << (w % 2 ? 0 : 4);
+        }
+        out.insert(out.end(), row.begin(), row.end());
+    }
+
+    return writeBytes(filename, out);
+}
+
+static bool writeBitmapPBM(const std::string &filename, const IndexedImage &image) {
+
+    const std::vector<pixel> &palette = image.getPalette();
+    if (palette.size() > 2) {
+        std::cerr << "Could not write " << filename << ", PBM needs a palette of at most 2 colors" << std::endl;
+        return false;
+    }
+
+    // in PBM a set bit is black. decide which palette entries are the dark ones
+    int black[2] = { 0, 0 };
+    for (size_t i = 0; i < palette.size(); ++i) {
+        const pixel &color = palette[i];
+        black[i] = 299 * color.r + 587 * color.g + 114 * color.b < 128 * 1000;
+    }
+
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P4\n%d %d\n", image.getWidth(), image.getHeight());
+    std::vector<unsigned char> out(header, header + length);
+
+    // 1 bit images already have the PBM layout, at most the bits need flipping
+    size_t stride = image.getStride();
+    for (int h = 0; h < image.getHeight(); ++h) {
+        const unsigned char *row = image.row(h);
+        for (size_t i = 0; i < stride; ++i) {
+            unsigned char byte = row[i];
+            if (black[0] == black[1])
+                byte = black[0] ? 0xff : 0x00;
+            else if (black[0])
+                byte = ~byte;
+            out.push_back(byte);
+        }
+    }
+
+    return writeBytes(filename, out);
+}
+
+// packs variable width LZW codes into GIF's 255 byte sub-blocks
+struct GifBitWriter {
+    std::vector<unsigned char> &out;
+    unsigned char block[256];
+    int blockSize;
+    std::uint32_t bits;
+    int nbits;
+
+    explicit GifBitWriter(std::vector<unsigned char> &out) : out(out), blockSize(0), bits(0), nbits(0) {}
+
+    void write(int code, int size) {
+        bits |= (std::uint32_t)code << nbits;
+        nbits += size;
+        while (nbits >= 8) {
+            putByte(bits & 0xff);
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+
+    void putByte(unsigned char byte) {
+        block[blockSize++] = byte;
+        if (blockSize == 255)
+            flushBlock();
+    }
+
+    void flushBlock() {
+        if (blockSize == 0)
+            return;
+        out.push_back((unsigned char)blockSize);
+        out.insert(out.end(), block, block + blockSize);
+        blockSize = 0;
+    }
+
+    void finish() {
+        if (nbits > 0)
+            putByte(bits & 0xff);
+        flushBlock();
+        out.push_back(0);  // block terminator
+    }
+};
+
+#define GIF_MAX_CODE 4095
+#define GIF_HASH_SIZE 8192
+
+static void encodePalettedGIF(const IndexedImage &image, std::vector<unsigned char> &out) {
+
+    int width = image.getWidth();
+    int height = image.getHeight();
+    int bits = image.getBits();
+    const std::vector<pixel> &palette = image.getPalette();
+
+    const char *signature = "GIF89a";
+    out.insert(out.end(), signature, signature + 6);
+    put16LE(out, width);
+    put16LE(out, height);
+    out.push_back(0x80 | 0x70 | (bits - 1));  // global color table of 2^bits entries
+    out.push_back(0);                         // background color
+    out.push_back(0);                         // square pixels
+
+    int transparent = -1;
+    for (int i = 0; i < (1 << bits); ++i) {
+        pixel color = i < (int)palette.size() ? palette[i] : pixel(0, 0, 0, 255);
+        out.push_back(color.r);
+        out.push_back(color.g);
+        out.push_back(color.b);
+        if (transparent < 0 && i < (int)palette.size() && color.a < 128)
+            transparent = i;
+    }
+
+    if (transparent >= 0) {
+        // graphic control extension, GIF can only make one color fully transparent
+        const unsigned char extension[] = { 0x21, 0xf9, 0x04, 0x01, 0, 0, (unsigned char)transparent, 0 };
+        out.insert(out.end(), extension, extension + sizeof(extension));
+    }
+
+    out.push_back(0x2c);  // image descriptor
+    put16LE(out, 0);
+    put16LE(out, 0);
+    put16LE(out, width);
+    put16LE(out, height);
+    out.push_back(0);
+
+    int minCodeSize = std::max(bits, 2);
+    out.push_back(minCodeSize);
+
+    // LZW, with the string table kept in an open addressing hash of
+    // (prefix code, next index) -> code
+    int clearCode = 1 << minCodeSize;
+    std::vector<std::int32_t> keys(GIF_HASH_SIZE), codes(GIF_HASH_SIZE);
+    std::fill(keys.begin(), keys.end(), -1);
+    int codeSize = minCodeSize + 1;
+    int nextCode = clearCode + 2;
+
+    GifBitWriter writer(out);
+    writer.write(clearCode, codeSize);
+
+    int prefix = -1;
+    for (int h = 0; h < height; ++h) {
+        for (int w = 0; w < width; ++w) {
+            int index = image.getIndex(h, w);
+            if (prefix < 0) {
+                prefix = index;
+                continue;
+            }
+
+            std::int32_t key = (prefix << 8) | index;
+            int slot = (key * 31) & (GIF_HASH_SIZE - 1);
+            while (keys[slot] >= 0 && keys[slot] != key)
+                slot = (slot + 1) & (GIF_HASH_SIZE - 1);
+
+            if (keys[slot] == key) {
+                prefix = codes[slot];  // the string goes on
+                continue;
+            }
+
+            writer.write(prefix, codeSize);
+
+            keys[slot] = key;
+            codes[slot] = nextCode;
+            if (nextCode >= (1 << codeSize))
+                codeSize++;
+
+            if (nextCode == GIF_MAX_CODE) {
+                // table is full, start over
+                writer.write(clearCode, codeSize);
+                std::fill(keys.begin(), keys.end(), -1);
+                codeSize = minCodeSize + 1;
+                nextCode = clearCode + 2;
+            }
+            else
+                nextCode++;
+
+            prefix = index;
+        }
+    }
+
+    if (prefix >= 0) {
+        writer.write(prefix, codeSize);
+        // the decoder adds a string after this code like after any other, and
+        // widens its codes when that fills the current width
+        if (nextCode >= (1 << codeSize) && codeSize < 12)
+            codeSize++;
+    }
+    writer.write(clearCode + 1, codeSize);  // end of information
+    writer.finish();
+
+    out.push_back(0x3b);  // trailer
+}
+
+static bool writePalettedGIF(const std::string &filename, const IndexedImage &image) {
+    std::vector<unsigned char> out;
+    encodePalettedGIF(image, out);
+    return writeBytes(filename, out);
+}
+
+// decode the indices of a GIF written by encodePalettedGIF, the way giflib
+// does. lastWidened tells whether the code before the end of information made
+// the codes one bit wider, which is where encoders tend to go wrong
+static bool decodePalettedGIF(const std::vector<unsigned char> &gif, std::vector<unsigned char> &indices,
+                              bool &lastWidened) {
+
+    if (gif.size() < 13)
+        return false;
+    size_t at = 13;
+    if (gif[10] & 0x80)
+        at += 3 * ((size_t)2 << (gif[10] & 7));
+    if (at < gif.size() && gif[at] == 0x21)
+        at += 8;  // graphic control extension
+    at += 10;     // image descriptor
+    if (at >= gif.size())
+        return false;
+    int width = gif[at - 5] | (gif[at - 4] << 8), height = gif[at - 3] | (gif[at - 2] << 8);
+    int minCodeSize = gif[at++];
+
+    std::vector<unsigned char> data;  // the sub-blocks joined up
+    while (at < gif.size() && gif[at] != 0) {
+        size_t size = gif[at++];
+        if (at + size > gif.size())
+            return false;
+        data.insert(data.end(), gif.begin() + at, gif.begin() + at + size);
+        at += size;
+    }
+
+    int clearCode = 1 << minCodeSize;
+    int codeSize = minCodeSize + 1, nextCode = clearCode + 2, previous = -1;
+    std::vector<int> prefixes(GIF_MAX_CODE + 1), suffixes(GIF_MAX_CODE + 1);
+    std::vector<unsigned char> string;
+    size_t bit = 0;
+
+    indices.clear();
+    lastWidened = false;
+    for (;;) {
+        if (bit + codeSize > 8 * data.size())
+            return false;
+        int code = 0;
+        for (int i = 0; i < codeSize; ++i, ++bit)
+            code |= ((data[bit / 8] >> (bit % 8)) & 1) << i;
+
+        if (code == clearCode) {
+            codeSize = minCodeSize + 1;
+            nextCode = clearCode + 2;
+            previous = -1;
+            continue;
+        }
+        if (code == clearCode + 1)
+            return indices.size() == (size_t)width * height;
+        if (code > nextCode || (previous < 0 && code >= clearCode))
+            return false;
+
+        // the string of the code, backwards, then its first index
+        int walk = code == nextCode ? previous : code;
+        string.clear();
+        while (walk >= clearCode) {
+            string.push_back((unsigned char)suffixes[walk]);
+            walk = prefixes[walk];
+        }
+        string.push_back((unsigned char)walk);
+        unsigned char first = string.back();
+        indices.insert(indices.end(), string.rbegin(), string.rend());
+        if (code == nextCode)
+            indices.push_back(first);
+
+        lastWidened = false;
+        if (previous >= 0 && nextCode <= GIF_MAX_CODE) {
+            prefixes[nextCode] = previous;
+            suffixes[nextCode] = first;
+            nextCode++;
+            if (nextCode == (1 << codeSize) && codeSize < 12) {
+                codeSize++;
+                lastWidened = true;
+            }
+        }
+        previous = code;
+    }
+}
+
+bool gifSelfCheck(std::ostream &out) {
+
+    // two color noise of every length from 1 to 600 pixels, which ends on a
+    // code that widens the codes a few times along the way
+    std::vector<pixel> palette(2);
+    palette[1] = pixel(255, 255, 255, 255);
+    unsigned int seed = 1;
+    int widened = 0, failed = 0;
+
+    for (int width = 1; width <= 600; ++width) {
+        IndexedImage image(width, 1, palette);
+        for (int w = 0; w < width; ++w) {
+            seed = seed * 1103515245 + 12345;
+            image.setIndex(0, w, (seed >> 16) & 1);
+        }
+
+        std::vector<unsigned char> gif, indices;
+        bool lastWidened;
+        encodePalettedGIF(image, gif);
+        bool same = decodePalettedGIF(gif, indices, lastWidened);
+        for (int w = 0; same && w < width; ++w)
+            same = indices[w] == image.getIndex(0, w);
+
+        failed += !same;
+        widened += same && lastWidened;
+    }
+
+    bool ok = failed == 0 && widened > 0;
+    out << "gif round trip: " << (ok ? "ok" : "failed") << " (" << failed << " of 600 differ, "
+        << widened << " end on a wider code)\n";
+    return ok;
+}
+
+static std::string extensionOf(const std::string &filename) {
+
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos)
+        return "";
+
+    std::string extension = filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+bool writeIndexedFile(const std::string &filename, const IndexedImage &image,
+                      const WriteOptions &options) {
+
+    std::string extension = extensionOf(filename);
+
+    if (extension == "png")
+        return writePalettedPNG(filename, image, options);
+    if (extension == "gif")
+        return writePalettedGIF(filename, image);
+    if (extension == "bmp")
+        return writePalettedBMP(filename, image);
+    if (extension == "pbm")
+        return writeBitmapPBM(filename, image);
+
+    // no paletted mode for this format, write the colors out
+    Image expanded = image.toImage();
+    return writeImageFile(filename, ImageSnapshot(expanded), options);
+}
+
+AsyncImageWriter::AsyncImageWriter() : inflight(0), stopping(false) {
+    worker = std::thread(&AsyncImageWriter::run, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    worker.join();
+}
+
+std::future<bool> AsyncImageWriter::save(const std::string &filename, Image &image,
+                                         const WriteOptions &options) {
+
+    Job *job = new Job;
+    job->filename = filename;
+    job->snapshot = ImageSnapshot(image);  // copy now, encode later
+    job->options = options;
+
+    return enqueue(job);
+}
+
+std::future<bool> AsyncImageWriter::save(const std::string &filename, const IndexedImage &image,
+                                         const WriteOptions &options) {
+
+    Job *job = new Job;
+    job->filename = filename;
+    job->indexed = image.clone();
+    job->options = options;
+
+    return enqueue(job);
+}
+
+std::future<bool> AsyncImageWriter::enqueue(Job *job) {
+
+    std::future<bool> result = job->done.get_future();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+        inflight++;
+    }
+    wakeup.notify_one();
+
+    return result;
+}
+
+void AsyncImageWriter::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    drained.wait(guard, [this] { return inflight == 0; });
+}
+
+size_t AsyncImageWriter::pending() {
+    std::lock_guard<std::mutex> guard(lock);
+    return inflight;
+}
+
+// the background thread, drains the queue till we are told to stop
+// and nothing is left to write
+void AsyncImageWriter::run() {
+
+    for (;;) {
+        Job *job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeup.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;  // stopping and nothing left to do
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        bool ok;
+        if (job->indexed.getWidth() > 0)
+            ok = writeIndexedFile(job->filename, job->indexed, job->options);
+        else
+            ok = writeImageFile(job->filename, job->snapshot, job->options);
+        if (ok)
+            std::cout << "Saved " << job->filename << " successfully." << std::endl;
+        job->done.set_value(ok);
+        delete job;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            inflight--;
+        }
+        drained.notify_all();
+    }
+}
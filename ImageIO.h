@@ -0,0 +1,106 @@
+// Header file for reading and writing images to disk through OIIO.
+// images can be saved right away or handed over to a background thread
+// that encodes them while the caller moves on to the next image
+
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "Image.h"
+#include <string>
+#include <ostream>
+#include <vector>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// how hard the encoder should try to shrink the output file
+enum CompressionPreset {
+    COMPRESS_FASTEST, COMPRESS_DEFAULT, COMPRESS_SMALLEST
+};
+
+// knobs for a single save
+struct WriteOptions {
+    CompressionPreset compression;
+    bool dropRedundantChannels;  // write grey / no alpha when the pixels allow it
+    int tileSize;                // tile edge for formats that support tiles(tiff, exr), 0 for scanlines
+    int threads;                 // encoder threads, 0 lets the library decide
+
+    WriteOptions() : compression(COMPRESS_DEFAULT), dropRedundantChannels(true),
+                     tileSize(64), threads(0) {}
+};
+
+// a private copy of the pixels, so that the image can keep changing while
+// the copy is being encoded
+struct ImageSnapshot {
+    int width, height;
+    std::vector<unsigned char> pixels;  // always RGBA
+
+    ImageSnapshot() : width(0), height(0) {}
+    explicit ImageSnapshot(Image &image);
+};
+
+// decode the whole file into an RGBA image, blocks till it is read. errors are
+// reported on stderr and leave the image alone. with the raw pixel cache
+// turned on(see RawCache.h), files that were read before skip the decoding
+bool readImageFile(const std::string &filename, Image &image);
+
+// just the dimensions of an image file, without decoding its pixels
+bool probeImageFile(const std::string &filename, int &width, int &height, int &channels);
+
+// the smallest number of channels(1 = grey, 2 = grey + alpha, 3 = RGB, 4 = RGBA)
+// that can represent the given RGBA pixels without any loss
+int essentialChannels(const unsigned char *rgba, size_t npixels);
+
+// encode the snapshot into the given file, blocks till the file is closed
+bool writeImageFile(const std::string &filename, const ImageSnapshot &snapshot,
+                    const WriteOptions &options = WriteOptions());
+
+// write a palette indexed image. .png, .gif and .bmp files are written as
+// paletted images and .pbm as a bitmap(2 color palettes only), any other
+// format gets the image expanded and written through writeImageFile
+bool writeIndexedFile(const std::string &filename, const IndexedImage &image,
+                      const WriteOptions &options = WriteOptions());
+
+// encode and decode paletted GIFs of many sizes and check the indices come
+// back, reports on the given stream
+bool gifSelfCheck(std::ostream &out);
+
+// saves images on a single background thread, in the order they were queued
+class AsyncImageWriter {
+private:
+    struct Job {
+        std::string filename;
+        ImageSnapshot snapshot;
+        IndexedImage indexed;  // written instead of the snapshot when it holds an image
+        WriteOptions options;
+        std::promise<bool> done;
+    };
+
+    std::deque<Job*> queue;
+    std::mutex lock;
+    std::condition_variable wakeup;   // signalled when a job is queued or on shutdown
+    std::condition_variable drained;  // signalled every time a job finishes
+    size_t inflight;                  // queued + currently being written
+    bool stopping;
+    std::thread worker;
+
+    std::future<bool> enqueue(Job *job);
+    void run();
+public:
+    AsyncImageWriter();
+    ~AsyncImageWriter();  // finishes all the pending saves before returning
+
+    // snapshot the image right now and write it out in the background
+    std::future<bool> save(const std::string &filename, Image &image,
+                           const WriteOptions &options = WriteOptions());
+    std::future<bool> save(const std::string &filename, const IndexedImage &image,
+                           const WriteOptions &options = WriteOptions());
+
+    // block until every queued save has been written
+    void wait();
+    size_t pending();
+};
+
+#endif
@@ -0,0 +1,102 @@
+/*
+  packing and unpacking of palette indexed images
+*/
+
+#include "IndexedImage.h"
+#include "Image.h"
+#include <string.h>
+
+int IndexedImage::bitsFor(size_t colors) {
+    if (colors <= 2) return 1;
+    if (colors <= 4) return 2;
+    if (colors <= 16) return 4;
+    return 8;
+}
+
+IndexedImage::IndexedImage(int width, int height, const std::vector<pixel> &palette) :
+width(width), height(height), bits(bitsFor(palette.size())),
+stride(((size_t)width * bits + 7) / 8),
+buffer(stride * height), palette(palette)
+{
+    indices = buffer.data();
+    if (indices)
+        memset(indices, 0, stride * height);
+}
+
+IndexedImage::IndexedImage(IndexedImage &&other) noexcept :
+width(other.width), height(other.height), bits(other.bits), stride(other.stride),
+buffer(std::move(other.buffer)), indices(other.indices), palette(std::move(other.palette))
+{
+    other.width = other.height = other.bits = 0;
+    other.stride = 0;
+    other.indices = nullptr;
+}
+
+IndexedImage& IndexedImage::operator=(IndexedImage &&other) noexcept {
+
+    if (this != &other) {
+        width = other.width;
+        height = other.height;
+        bits = other.bits;
+        stride = other.stride;
+        buffer = std::move(other.buffer);
+        indices = other.indices;
+        palette = std::move(other.palette);
+
+        other.width = other.height = other.bits = 0;
+        other.stride = 0;
+        other.indices = nullptr;
+    }
+
+    return *this;
+}
+
+IndexedImage IndexedImage::clone() const {
+
+    IndexedImage copy(width, height, palette);
+    if (indices)
+        memcpy(copy.indices, indices, stride * height);
+
+    return copy;
+}
+
+void IndexedImage::setRow(int h, const unsigned char *rowIndices) {
+
+    unsigned char *out = row(h);
+
+    if (bits == 8) {
+        memcpy(out, rowIndices, width);
+        return;
+    }
+
+    // gather perByte indices into every output byte, first index in the high bits
+    int perByte = 8 / bits;
+    for (int w = 0; w < width; w += perByte) {
+        unsigned char byte = 0;
+        for (int k = 0; k < perByte; ++k) {
+            int index = w + k < width ? rowIndices[w + k] : 0;
+            byte = (unsigned char)((byte << bits) | index);
+        }
+        *out++ = byte;
+    }
+}
+
+void IndexedImage::expandRow(int h, unsigned char *rgba) const {
+
+    for (int w = 0; w < width; ++w, rgba += 4) {
+        const pixel &color = palette[getIndex(h, w)];
+        rgba[0] = color.r;
+        rgba[1] = color.g;
+        rgba[2] = color.b;
+        rgba[3] = color.a;
+    }
+}
+
+Image IndexedImage::toImage() const {
+
+    Image image(width, height, 4);
+    for (int h = 0; h < height; ++h)
+        expandRow(h, image.row(h));
+
+    return image;
+}
@@ -0,0 +1,73 @@
+// Header file for images stored as palette indices.
+// after a palette reduction every pixel is one of a handful of colors, so
+// instead of 4 bytes per pixel we keep the palette once and pack the index of
+// each pixel into 1, 2, 4 or 8 bits. scanlines are packed most significant
+// bit first, which is the layout PNG, BMP and PBM all use on disk
+
+#ifndef INDEXED_IMAGE_H
+#define INDEXED_IMAGE_H
+
+#include "pixel.h"
+#include "PixelAllocator.h"
+#include <vector>
+
+class Image;
+
+class IndexedImage {
+private:
+    int width, height;
+    int bits;              // bits per index
+    size_t stride;         // bytes per scanline
+    PixelBuffer buffer;
+    unsigned char *indices;
+    std::vector<pixel> palette;
+public:
+    IndexedImage() : width(0), height(0), bits(0), stride(0), indices(nullptr) {}
+    IndexedImage(int width, int height, const std::vector<pixel> &palette);
+
+    IndexedImage(IndexedImage &&other) noexcept;
+    IndexedImage& operator=(IndexedImage &&other) noexcept;
+    IndexedImage(const IndexedImage&) = delete;
+    IndexedImage& operator=(const IndexedImage&) = delete;
+
+    IndexedImage clone() const;  // deep copy
+
+    // smallest of 1, 2, 4 or 8 bits that can index the given number of colors
+    static int bitsFor(size_t colors);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getBits() const { return bits; }
+    size_t getStride() const { return stride; }
+    size_t getBytes() const { return stride * height; }
+    const std::vector<pixel>& getPalette() const { return palette; }
+
+    unsigned char* row(int h) { return indices + stride * h; }
+    const unsigned char* row(int h) const { return indices + stride * h; }
+
+    // index at scanline h, column w
+    int getIndex(int h, int w) const {
+        int perByte = 8 / bits;
+        int shift = 8 - bits * (w % perByte + 1);
+        return (row(h)[w / perByte] >> shift) & ((1 << bits) - 1);
+    }
+
+    void setIndex(int h, int w, int index) {
+        int perByte = 8 / bits;
+        int shift = 8 - bits * (w % perByte + 1);
+        unsigned char mask = (unsigned char)(((1 << bits) - 1) << shift);
+        unsigned char &byte = row(h)[w / perByte];
+        byte = (unsigned char)((byte & ~mask) | (index << shift));
+    }
+
+    // pack a whole scanline of 8 bit indices
+    void setRow(int h, const unsigned char *rowIndices);
+
+    // expand one scanline back to RGBA
+    void expandRow(int h, unsigned char *rgba) const;
+
+    // back to a full RGBA image, for display or further processing
+    Image toImage() const;
+};
+
+#endif
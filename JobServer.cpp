@@ -0,0 +1,998 @@
+/*
+  the job server: parses requests, runs them on the worker pool and keeps the
+  decoded images and median cut palettes around for the jobs that follow.
+
+  nothing in here writes to stdout, in stream mode that is where the answers go
+*/
+
+#include "JobServer.h"
+#include "ImageIO.h"
+#include "Pipeline.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef std::chrono::steady_clock Clock;
+
+#define MAX_REQUEST_BYTES (1 << 20)  // longest line we accept from a client
+#define MAX_OVERTAKES 16             // jobs that may start ahead of one waiting for memory
+
+enum OpKind { OP_RED, OP_GREEN, OP_BLUE, OP_INVERSE, OP_BITMAP, OP_REDUCE, OP_DITHER,
+              OP_GAUSSIAN, OP_BOX, OP_UNSHARP, OP_CONVOLVE, OP_RESIZE };
+
+struct JobOp {
+    OpKind kind;
+    std::vector<pixel> palette;  // explicit palette, or empty when picked by median cut
+    int colors;                  // palette size for median cut
+    int preview;                 // longest side median cut looks at, 0 for the whole image
+    ColorSpace space;
+    double sigma, amount;        // filters
+    int radius, threshold;
+    std::vector<float> kernel;   // convolve, size x size
+    int size;
+    int width, height;           // resize, 0 keeps the aspect ratio
+    ResizeFilter filter;
+    std::string text;            // the op as it was written, for the palette cache key
+};
+
+struct JobServer::Job {
+    std::string id;  // the request's id written back as JSON, empty if it had none
+    std::string input, output;
+    std::vector<JobOp> ops;
+    WriteOptions write;
+    Clock::time_point received;
+    std::string key;  // of the input, see fileKey
+    size_t budget;    // bytes of pixels it will hold at its peak
+};
+
+struct JobServer::Connection {
+    int socket;         // -1 when answering on a stream
+    std::ostream *out;
+    std::mutex lock;    // one answer at a time, so lines never interleave
+
+    Connection(int socket, std::ostream *out) : socket(socket), out(out) {}
+    ~Connection() {
+        if (socket >= 0)
+            close(socket);
+    }
+
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (socket < 0) {
+            *out << line << std::endl;
+            return;
+        }
+
+        std::string data = line + "\n";
+        for (size_t sent = 0; sent < data.size(); ) {
+            ssize_t n = write(socket, data.data() + sent, data.size() - sent);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;  // the client went away, nobody left to tell
+            sent += n;
+        }
+    }
+};
+
+static double millis(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static std::string answer(const std::string &id, bool ok, const std::string &fields) {
+    std::string line = "{";
+    if (!id.empty())
+        line += "\"id\":" + id + ",";
+    line += ok ? "\"ok\":true" : "\"ok\":false";
+    if (!fields.empty())
+        line += "," + fields;
+    return line + "}";
+}
+
+static std::string failure(const std::string &id, const std::string &error) {
+    return answer(id, false, "\"error\":" + jsonQuote(error));
+}
+
+// a numeric member of an op within [low, high], defaulting to fallback when
+// the op doesn't have it(required ones have a NaN fallback)
+static bool opNumber(const JsonValue &op, const char *name, double low, double high,
+                     double fallback, double &value, std::string &error) {
+
+    const JsonValue *member = op.get(name);
+    if (!member && fallback == fallback) {
+        value = fallback;
+        return true;
+    }
+    if (!member || !member->isNumber() || member->number < low || member->number > high) {
+        error = std::string("\"") + name + "\" must be a number from " + std::to_string((int)low) +
+                " to " + std::to_string((int)high);
+        return false;
+    }
+
+    value = member->number;
+    return true;
+}
+
+static bool parseFilter(const std::string &name, ResizeFilter &filter) {
+    if (name == "nearest")       filter = RESIZE_NEAREST;
+    else if (name == "bilinear") filter = RESIZE_BILINEAR;
+    else if (name == "bicubic")  filter = RESIZE_BICUBIC;
+    else if (name == "lanczos3") filter = RESIZE_LANCZOS3;
+    else return false;
+    return true;
+}
+
+// the size a resize op ends up with from an image of width x height
+static void resizedSize(const JobOp &op, int width, int height, int &newWidth, int &newHeight) {
+    newWidth = op.width;
+    newHeight = op.height;
+    if (newWidth == 0)
+        newWidth = std::max(1, (int)lround((double)width * newHeight / height));
+    if (newHeight == 0)
+        newHeight = std::max(1, (int)lround((double)height * newWidth / width));
+}
+
+static bool parseSpace(const std::string &name, ColorSpace &space) {
+    if (name == "srgb")        space = SPACE_SRGB;
+    else if (name == "linear") space = SPACE_LINEAR;
+    else if (name == "lab")    space = SPACE_LAB;
+    else if (name == "oklab")  space = SPACE_OKLAB;
+    else return false;
+    return true;
+}
+
+// the cache key of a file: its name, size and modification time, so that a
+// file rewritten between jobs is decoded again
+static bool fileKey(const std::string &filename, std::string &key) {
+
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+        return false;
+
+#ifdef __APPLE__
+    long nanoseconds = info.st_mtimespec.tv_nsec;
+#else
+    long nanoseconds = info.st_mtim.tv_nsec;
+#endif
+    key = filename + "|" + std::to_string((long long)info.st_size) + "|" +
+          std::to_string((long long)info.st_mtime) + "." + std::to_string(nanoseconds);
+    return true;
+}
+
+JobServer::JobServer(const ServerOptions &options) :
+options(options), cachedBytes(0), generations(0), memoryInUse(0), running(0), overtaken(0), jobsDone(0), jobsFailed(0),
+imageHits(0), imageMisses(0), paletteHits(0), paletteMisses(0), stopping(false),
+pool(options.threads)
+{
+}
+
+JobServer::~JobServer() {
+    pool.wait();
+}
+
+bool JobServer::parseJob(const JsonValue &request, Job &job, std::string &error) {
+
+    const JsonValue *input = request.get("input");
+    const JsonValue *output = request.get("output");
+    if (!input || !input->isString() || !output || !output->isString()) {
+        error = "a job needs \"input\" and \"output\" file names";
+        return false;
+    }
+    job.input = input->string;
+    job.output = output->string;
+
+    const JsonValue *compression = request.get("compression");
+    if (compression) {
+        std::string preset = compression->isString() ? compression->string : "";
+        if (preset == "fastest")       job.write.compression = COMPRESS_FASTEST;
+        else if (preset == "default")  job.write.compression = COMPRESS_DEFAULT;
+        else if (preset == "smallest") job.write.compression = COMPRESS_SMALLEST;
+        else {
+            error = "compression is one of fastest, default or smallest";
+            return false;
+        }
+    }
+
+    const JsonValue *ops = request.get("ops");
+    if (!ops)
+        return true;  // a plain conversion
+    if (!ops->isArray()) {
+        error = "\"ops\" must be an array";
+        return false;
+    }
+
+    for (size_t i = 0; i < ops->array.size(); ++i) {
+        const JsonValue &value = ops->array[i];
+        const JsonValue *name = value.isObject() ? value.get("op") : &value;
+        if (!name || !name->isString()) {
+            error = "an op is a name or an object with an \"op\" name";
+            return false;
+        }
+
+        JobOp op;
+        op.colors = op.preview = 0;
+        op.space = SPACE_SRGB;
+        op.sigma = op.amount = 0;
+        op.radius = op.threshold = op.size = 0;
+        op.width = op.height = 0;
+        op.filter = RESIZE_LANCZOS3;
+        op.text = value.dump();
+
+        const std::string &kind = name->string;
+        if (kind == "greyscaleRed")        op.kind = OP_RED;
+        else if (kind == "greyscaleGreen") op.kind = OP_GREEN;
+        else if (kind == "greyscaleBlue")  op.kind = OP_BLUE;
+        else if (kind == "inverse")        op.kind = OP_INVERSE;
+        else if (kind == "toBitmap")       op.kind = OP_BITMAP;
+        else if (kind == "reducePalette")  op.kind = OP_REDUCE;
+        else if (kind == "floydSteinberg") op.kind = OP_DITHER;
+        else if (kind == "gaussianBlur")   op.kind = OP_GAUSSIAN;
+        else if (kind == "boxBlur")        op.kind = OP_BOX;
+        else if (kind == "unsharpMask")    op.kind = OP_UNSHARP;
+        else if (kind == "convolve")       op.kind = OP_CONVOLVE;
+        else if (kind == "resize")         op.kind = OP_RESIZE;
+        else {
+            error = "unknown op " + kind;
+            return false;
+        }
+
+        if (op.kind == OP_REDUCE || op.kind == OP_DITHER) {
+            const JsonValue *space = value.get("space");
+            if (space && !(space->isString() && parseSpace(space->string, op.space))) {
+                error = "space is one of srgb, linear, lab or oklab";
+                return false;
+            }
+
+            const JsonValue *palette = value.get("palette");
+            const JsonValue *colors = value.get("colors");
+            if (palette && palette->isArray() && !palette->array.empty() && palette->array.size() <= 256) {
+                for (size_t j = 0; j < palette->array.size(); ++j) {
+                    const JsonValue &entry = palette->array[j];
+                    int c[4] = { 0, 0, 0, 255 };
+                    bool valid = entry.isArray() && (entry.array.size() == 3 || entry.array.size() == 4);
+                    for (size_t k = 0; valid && k < entry.array.size(); ++k) {
+                        valid = entry.array[k].isNumber() && entry.array[k].number >= 0 &&
+                                entry.array[k].number <= 255;
+                        if (valid)
+                            c[k] = (int)entry.array[k].number;
+                    }
+                    if (!valid) {
+                        error = "palette entries are [r, g, b] or [r, g, b, a] with 0-255 values";
+                        return false;
+                    }
+                    op.palette.push_back(pixel(c[0], c[1], c[2], c[3]));
+                }
+            }
+            else if (colors && colors->isNumber() && colors->number >= 2 && colors->number <= 256) {
+                // median cut splits every bucket in two
+                op.colors = (int)colors->number;
+                if ((op.colors & (op.colors - 1)) != 0 || op.colors != colors->number) {
+                    error = "colors must be a power of two";
+                    return false;
+                }
+            }
+            else {
+                error = kind + " needs a \"palette\" of 1 to 256 colors or a number of \"colors\" from 2 to 256";
+                return false;
+            }
+
+            // median cut on a downscaled copy, when a close enough palette will do
+            double preview;
+            if (!opNumber(value, "preview", 16, 65535, 0, preview, error))
+                return false;
+            op.preview = (int)preview;
+        }
+
+        double radius, threshold;
+        const double required = NAN;
+        if (op.kind == OP_GAUSSIAN && !opNumber(value, "sigma", 0, 100, required, op.sigma, error))
+            return false;
+        if (op.kind == OP_BOX) {
+            if (!opNumber(value, "radius", 1, 300, required, radius, error))
+                return false;
+            op.radius = (int)radius;
+        }
+        if (op.kind == OP_UNSHARP) {
+            if (!opNumber(value, "sigma", 0, 100, required, op.sigma, error) ||
+                !opNumber(value, "amount", 0, 64, 1, op.amount, error) ||
+                !opNumber(value, "threshold", 0, 255, 0, threshold, error))
+                return false;
+            op.threshold = (int)threshold;
+        }
+        if (op.kind == OP_CONVOLVE) {
+            // a square array of rows with an odd size
+            const JsonValue *kernel = value.get("kernel");
+            size_t size = kernel && kernel->isArray() ? kernel->array.size() : 0;
+            bool valid = size % 2 == 1 && size <= 63;
+            for (size_t i = 0; valid && i < size; ++i) {
+                const JsonValue &row = kernel->array[i];
+                valid = row.isArray() && row.array.size() == size;
+                for (size_t j = 0; valid && j < size; ++j) {
+                    valid = row.array[j].isNumber();
+                    op.kernel.push_back(valid ? (float)row.array[j].number : 0.0f);
+                }
+            }
+            if (!valid) {
+                error = "convolve needs a \"kernel\" of n rows of n numbers, n odd and at most 63";
+                return false;
+            }
+            op.size = (int)size;
+        }
+        if (op.kind == OP_RESIZE) {
+            double width, height;
+            if (!opNumber(value, "width", 1, 65535, 0, width, error) ||
+                !opNumber(value, "height", 1, 65535, 0, height, error))
+                return false;
+            if (width == 0 && height == 0) {
+                error = "resize needs a \"width\", a \"height\" or both";
+                return false;
+            }
+            op.width = (int)width;
+            op.height = (int)height;
+
+            const JsonValue *filter = value.get("filter");
+            if (filter && !(filter->isString() && parseFilter(filter->string, op.filter))) {
+                error = "filter is one of nearest, bilinear, bicubic or lanczos3";
+                return false;
+            }
+        }
+
+        job.ops.push_back(op);
+    }
+
+    return true;
+}
+
+void JobServer::handleLine(const std::string &line, const std::shared_ptr<Connection> &connection) {
+
+    JsonValue request;
+    std::string error;
+    if (!parseJson(line, request, error)) {
+        connection->send(failure("", "bad request: " + error));
+        return;
+    }
+    if (!request.isObject()) {
+        connection->send(failure("", "bad request: expected an object"));
+        return;
+    }
+
+    std::shared_ptr<Job> job(new Job);
+    job->received = Clock::now();
+    const JsonValue *id = request.get("id");
+    if (id)
+        job->id = id->dump();
+
+    const JsonValue *command = request.get("cmd");
+    if (command) {
+        std::string name = command->isString() ? command->string : "";
+        if (name == "stats")
+            connection->send(answer(job->id, true, stats()));
+        else if (name == "shutdown") {
+            stopping = true;
+            connection->send(answer(job->id, true, ""));
+        }
+        else
+            connection->send(failure(job->id, "unknown command"));
+        return;
+    }
+
+    if (!parseJob(request, *job, error)) {
+        connection->send(failure(job->id, error));
+        return;
+    }
+    if (!planJob(*job, error)) {
+        jobsFailed++;
+        connection->send(failure(job->id, error));
+        return;
+    }
+
+    admit(job, connection);
+}
+
+std::string JobServer::stats() {
+
+    size_t imageCount, paletteCount, bytes;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        imageCount = images.size();
+        paletteCount = palettes.size();
+        bytes = cachedBytes;
+    }
+    size_t inUse, pending;
+    {
+        std::lock_guard<std::mutex> guard(memoryLock);
+        inUse = memoryInUse;
+        pending = waiting.size();
+    }
+
+    return "\"jobs_done\":" + std::to_string(jobsDone.load()) +
+           ",\"jobs_failed\":" + std::to_string(jobsFailed.load()) +
+           ",\"jobs_pending\":" + std::to_string(pool.pending() + pending) +
+           ",\"threads\":" + std::to_string(pool.size()) +
+           ",\"image_hits\":" + std::to_string(imageHits.load()) +
+           ",\"image_misses\":" + std::to_string(imageMisses.load()) +
+           ",\"images_cached\":" + std::to_string(imageCount) +
+           ",\"image_cache_bytes\":" + std::to_string(bytes) +
+           ",\"palette_hits\":" + std::to_string(paletteHits.load()) +
+           ",\"palette_misses\":" + std::to_string(paletteMisses.load()) +
+           ",\"palettes_cached\":" + std::to_string(paletteCount) +
+           ",\"memory_in_use\":" + std::to_string(inUse) +
+           ",\"memory_limit\":" + std::to_string(options.memoryLimit);
+}
+
+// drop an entry from one of the caches, unless it was evicted and the key
+// now belongs to a newer one
+template <class Entry>
+void JobServer::forget(const std::string &key, unsigned long generation, std::map<std::string, Entry> &cache,
+                       std::list<std::string> &order) {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    typename std::map<std::string, Entry>::iterator found = cache.find(key);
+    if (found != cache.end() && found->second.generation == generation) {
+        order.erase(found->second.order);
+        cache.erase(found);
+    }
+}
+
+// the decoded pixels of a file, from the cache or decoded now. jobs asking
+// for a file that another job is decoding wait for that one instead of
+// decoding it again
+std::shared_ptr<Image> JobServer::decoded(const std::string &key, const std::string &filename, bool &hit) {
+
+    std::promise<std::shared_ptr<Image> > promise;
+    std::shared_future<std::shared_ptr<Image> > cached;
+    unsigned long generation = 0;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        std::map<std::string, CachedImage>::iterator found = images.find(key);
+        hit = found != images.end();
+        if (hit) {
+            imageOrder.splice(imageOrder.begin(), imageOrder, found->second.order);
+            cached = found->second.image;
+            imageHits++;
+        }
+        else {
+            CachedImage &entry = images[key];
+            entry.image = promise.get_future().share();
+            entry.bytes = 0;
+            imageOrder.push_front(key);
+            entry.order = imageOrder.begin();
+            entry.generation = generation = ++generations;
+            imageMisses++;
+        }
+    }
+    if (hit)
+        return cached.get();  // waits if it is still being decoded
+
+    // out of memory fails this job and the ones waiting on it, but the
+    // entry still has to go
+    std::shared_ptr<Image> image;
+    try {
+        image.reset(new Image());
+        if (!readImageFile(filename, *image))
+            image.reset();
+        promise.set_value(image);
+    }
+    catch (...) {
+        forget(key, generation, images, imageOrder);
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    // the entry may have been evicted meanwhile, and even replaced by another
+    // job's decode of the same file, which does its own accounting
+    std::lock_guard<std::mutex> guard(cacheLock);
+    std::map<std::string, CachedImage>::iterator entry = images.find(key);
+    if (entry != images.end() && entry->second.generation == generation) {
+        if (!image) {
+            // don't remember failures, the file may be fixed by the next job
+            imageOrder.erase(entry->second.order);
+            images.erase(entry);
+        }
+        else {
+            entry->second.bytes = 4 * (size_t)image->getWidth() * image->getHeight();
+            cachedBytes += entry->second.bytes;
+        }
+    }
+
+    // drop the least recently used images till the rest fit. the jobs using
+    // them keep their own reference. the ones still being decoded aren't
+    // counted yet and stay, or a second decode of the file would start
+    std::list<std::string>::iterator next = imageOrder.end();
+    while (cachedBytes > options.imageCacheBytes && next != imageOrder.begin()) {
+        std::map<std::string, CachedImage>::iterator oldest = images.find(*--next);
+        std::shared_future<std::shared_ptr<Image> > &decoding = oldest->second.image;
+        if (decoding.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            continue;
+        cachedBytes -= oldest->second.bytes;
+        next = imageOrder.erase(next);
+        images.erase(oldest);
+    }
+
+    return image;
+}
+
+// dimensions of an image that is already cached, without waiting on it
+bool JobServer::peekSize(const std::string &key, int &width, int &height) {
+
+    std::shared_future<std::shared_ptr<Image> > image;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        std::map<std::string, CachedImage>::iterator found = images.find(key);
+        if (found == images.end() || found->second.bytes == 0)
+            return false;
+        image = found->second.image;
+    }
+
+    width = image.get()->getWidth();
+    height = image.get()->getHeight();
+    return true;
+}
+
+std::vector<pixel> JobServer::medianCutPalette(const std::string &key, Image &image, int colors, ColorSpace space) {
+
+    std::promise<std::vector<pixel> > promise;
+    std::shared_future<std::vector<pixel> > cached;
+    unsigned long generation = 0;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        std::map<std::string, CachedPalette>::iterator found = palettes.find(key);
+        if (found != palettes.end()) {
+            paletteOrder.splice(paletteOrder.begin(), paletteOrder, found->second.order);
+            cached = found->second.palette;
+            paletteHits++;
+        }
+        else {
+            paletteOrder.push_front(key);
+            CachedPalette &entry = palettes[key];
+            entry.palette = promise.get_future().share();
+            entry.order = paletteOrder.begin();
+            entry.generation = generation = ++generations;
+            paletteMisses++;
+
+            while (palettes.size() > options.paletteCacheEntries) {
+                palettes.erase(paletteOrder.back());
+                paletteOrder.pop_back();
+            }
+        }
+    }
+    if (cached.valid())
+        return cached.get();
+
+    std::vector<pixel> palette(colors, pixel());
+    try {
+        image.getReducedPalette(palette, space);
+        promise.set_value(palette);
+    }
+    catch (...) {
+        forget(key, generation, palettes, paletteOrder);
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    return palette;
+}
+
+// queue the job till a worker is free and the running jobs leave room for
+// it, so that the workers never sit waiting on the budget themselves
+void JobServer::admit(const std::shared_ptr<Job> &job, const std::shared_ptr<Connection> &connection) {
+    std::lock_guard<std::mutex> guard(memoryLock);
+    Waiting entry = { job, connection };
+    waiting.push_back(entry);
+    dispatch();
+}
+
+// start whatever fits, oldest first. a job bigger than the whole budget still
+// gets to run, just alone, and a job that doesn't fit yet lets the ones behind
+// it that do go first, up to MAX_OVERTAKES of them. called with memoryLock held
+void JobServer::dispatch() {
+
+    while (running < pool.size() && !waiting.empty()) {
+
+        size_t chosen = waiting.size();
+        size_t candidates = overtaken < MAX_OVERTAKES ? waiting.size() : 1;
+        for (size_t i = 0; i < candidates && chosen == waiting.size(); ++i) {
+            size_t bytes = waiting[i].job->budget;
+            if (memoryInUse == 0 || memoryInUse + bytes <= options.memoryLimit)
+                chosen = i;
+        }
+        if (chosen == waiting.size())
+            return;
+
+        Waiting next = waiting[chosen];
+        waiting.erase(waiting.begin() + chosen);
+        overtaken = chosen > 0 ? overtaken + 1 : 0;
+        memoryInUse += next.job->budget;
+        running++;
+
+        pool.submit([this, next] { runJob(next.job, next.connection); });
+    }
+}
+
+// a job is done with its memory and its worker. the next jobs are handed to
+// the pool before this one's task returns, so pool.wait() never sees a gap
+void JobServer::release(size_t bytes) {
+    std::lock_guard<std::mutex> guard(memoryLock);
+    memoryInUse -= bytes;
+    running--;
+    dispatch();
+}
+
+// run the job's operations on a copy of the decoded image and write it out
+bool JobServer::process(const Job &job, const std::string &key, Image &source,
+                        Clock::time_point &processed, std::string &error) {
+
+    Image image = source.clone();
+
+    // the output's indices when the last op was a palette op, or whether it
+    // was toBitmap(which keeps alpha, so the palette comes later)
+    IndexedImage indexed;
+    bool bitmap = false;
+
+    Pipeline pipeline(image);
+    std::string applied;  // ops so far, part of the palette cache key
+    for (size_t i = 0; i < job.ops.size(); ++i) {
+        const JobOp &op = job.ops[i];
+        switch (op.kind) {
+            case OP_RED:     pipeline.greyscaleRed(); break;
+            case OP_GREEN:   pipeline.greyscaleGreen(); break;
+            case OP_BLUE:    pipeline.greyscaleBlue(); break;
+            case OP_INVERSE: pipeline.inverse(); break;
+            case OP_BITMAP:  pipeline.toBitmap(); break;
+            // the filters look at the neighbours, so whatever is pending runs first
+            case OP_GAUSSIAN:
+                pipeline.run();
+                image.gaussianBlur((float)op.sigma);
+                break;
+            case OP_BOX:
+                pipeline.run();
+                image.boxBlur(op.radius);
+                break;
+            case OP_UNSHARP:
+                pipeline.run();
+                image.unsharpMask((float)op.sigma, (float)op.amount, op.threshold);
+                break;
+            case OP_CONVOLVE:
+                pipeline.run();
+                if (!image.convolve(op.kernel, op.size)) {
+                    error = "convolve kernel is too strong";
+                    return false;
+                }
+                break;
+            case OP_RESIZE: {
+                pipeline.run();
+                int width, height;
+                resizedSize(op, image.getWidth(), image.getHeight(), width, height);
+                image = image.resize(width, height, op.filter);
+                break;
+            }
+            case OP_REDUCE:
+            case OP_DITHER: {
+                std::vector<pixel> palette = op.palette;
+                if (palette.empty()) {
+                    // median cut needs the pixels as they are at this point
+                    pipeline.run();
+                    std::string paletteKey = key + "|" + applied + "|" + std::to_string(op.colors) +
+                                             "|" + colorSpaceName(op.space) + "|" + std::to_string(op.preview);
+                    if (op.preview > 0) {
+                        Image preview = image.resizeToFit(op.preview, op.preview, RESIZE_BILINEAR);
+                        palette = medianCutPalette(paletteKey, preview, op.colors, op.space);
+                    }
+                    else
+                        palette = medianCutPalette(paletteKey, image, op.colors, op.space);
+                }
+                if (i + 1 == job.ops.size()) {
+                    // the output is paletted, its indices come out of the
+                    // same pass that quantizes the pixels
+                    pipeline.run();
+                    if (op.kind == OP_REDUCE)
+                        indexed = image.reducePaletteIndexed(palette, op.space);
+                    else
+                        indexed = image.floydSteinbergIndexed(palette, op.space);
+                }
+                else if (op.kind == OP_REDUCE)
+                    pipeline.reducePalette(palette, op.space);
+                else
+                    pipeline.floydSteinberg(palette, op.space);
+                break;
+            }
+        }
+
+        bitmap = op.kind == OP_BITMAP;
+        applied += op.text + ";";
+    }
+    pipeline.run();
+    processed = Clock::now();
+
+    if (bitmap)
+        indexed = image.indexBitmap();
+
+    // the indices are the result from here on, the pixels they came from
+    // don't have to stay around while it gets encoded
+    if (indexed.getWidth() > 0)
+        image = Image();
+
+    bool ok;
+    if (indexed.getWidth() > 0)
+        ok = writeIndexedFile(job.output, indexed, job.write);
+    else
+        ok = writeImageFile(job.output, ImageSnapshot(image), job.write);
+    if (!ok)
+        error = "could not write " + job.output;
+    return ok;
+}
+
+// find the job's input and work out what it will hold at its peak: the
+// working copy and the indexed output, plus the decode buffer and the decoded
+// image when not cached. only the headers are read
+bool JobServer::planJob(Job &job, std::string &error) {
+
+    if (!fileKey(job.input, job.key)) {
+        error = "could not open " + job.input;
+        return false;
+    }
+
+    int width, height, channels = 4;
+    size_t perPixel = 5;
+    if (!peekSize(job.key, width, height)) {
+        if (!probeImageFile(job.input, width, height, channels)) {
+            error = "could not read " + job.input;
+            return false;
+        }
+        perPixel += 4 + channels;
+    }
+    job.budget = perPixel * width * height;
+
+    // every resize makes another working copy(and output) of its own size
+    for (int i = 0, w = width, h = height; i < (int)job.ops.size(); ++i) {
+        if (job.ops[i].kind == OP_RESIZE) {
+            int resizedWidth, resizedHeight;
+            resizedSize(job.ops[i], w, h, resizedWidth, resizedHeight);
+            w = resizedWidth;
+            h = resizedHeight;
+            job.budget += 5 * (size_t)w * h;
+        }
+    }
+
+    return true;
+}
+
+// runs on a worker once admit() found room for the job
+void JobServer::runJob(const std::shared_ptr<Job> &job, const std::shared_ptr<Connection> &connection) {
+
+    const std::string &key = job->key;
+    Clock::time_point admitted = Clock::now();
+    Clock::time_point decodedAt = admitted, processed = admitted;
+    bool hit = false, ok = false;
+    std::string error;
+
+    try {
+        std::shared_ptr<Image> source = decoded(key, job->input, hit);
+        decodedAt = processed = Clock::now();
+        if (source)
+            ok = process(*job, key, *source, processed, error);
+        else
+            error = "could not read " + job->input;
+    }
+    catch (const std::exception &e) {
+        error = std::string("job failed: ") + e.what();  // out of memory most likely
+    }
+
+    release(job->budget);
+    Clock::time_point finished = Clock::now();
+
+    if (!ok) {
+        jobsFailed++;
+        connection->send(failure(job->id, error));
+        return;
+    }
+    jobsDone++;
+
+    char timing[256];
+    snprintf(timing, sizeof(timing),
+             "\"cached\":%s,\"queue_ms\":%.3f,\"decode_ms\":%.3f,\"process_ms\":%.3f,"
+             "\"encode_ms\":%.3f,\"total_ms\":%.3f",
+             hit ? "true" : "false", millis(admitted - job->received), millis(decodedAt - admitted),
+             millis(processed - decodedAt), millis(finished - processed), millis(finished - job->received));
+
+    connection->send(answer(job->id, true, "\"output\":" + jsonQuote(job->output) + "," + timing));
+}
+
+void JobServer::serveStream(std::istream &in, std::ostream &out) {
+
+    std::shared_ptr<Connection> connection(new Connection(-1, &out));
+
+    std::string line;
+    while (!stopping && std::getline(in, line))
+        if (line.find_first_not_of(" \t\r") != std::string::npos)
+            handleLine(line, connection);
+
+    pool.wait();
+}
+
+// one thread per client, reading its requests line by line. the socket is
+// closed once the client is done sending and the last of its jobs answered
+void JobServer::readConnection(Reader *reader) {
+
+    int socket = reader->socket;
+    std::shared_ptr<Connection> connection(new Connection(socket, nullptr));
+
+    std::string pending;
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = read(socket, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        pending.append(buffer, n);
+        size_t start = 0, end;
+        while ((end = pending.find('\n', start)) != std::string::npos) {
+            std::string line = pending.substr(start, end - start);
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                handleLine(line, connection);
+            start = end + 1;
+        }
+        pending.erase(0, start);
+
+        if (pending.size() > MAX_REQUEST_BYTES) {
+            connection->send(failure("", "request too long"));
+            break;
+        }
+    }
+
+    // stop reading, but leave the socket open for answers still to come
+    shutdown(socket, SHUT_RD);
+
+    std::lock_guard<std::mutex> guard(readersLock);
+    reader->done = true;
+}
+
+// join the readers whose clients are done, or all of them
+void JobServer::joinReaders(bool all) {
+
+    std::list<Reader> finished;
+    {
+        std::lock_guard<std::mutex> guard(readersLock);
+        for (std::list<Reader>::iterator i = readers.begin(); i != readers.end(); ) {
+            std::list<Reader>::iterator current = i++;
+            if (all || current->done)
+                finished.splice(finished.end(), readers, current);
+        }
+    }
+
+    // outside the lock, the readers still running take it on their way out
+    for (std::list<Reader>::iterator i = finished.begin(); i != finished.end(); ++i)
+        i->thread.join();
+}
+
+bool JobServer::serveSocket(const std::string &path) {
+
+    signal(SIGPIPE, SIG_IGN);  // a client hanging up early is not our problem
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path " << path << " is too long" << std::endl;
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "Could not create a socket, error = " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    unlink(path.c_str());  // left behind by a server that didn't shut down cleanly
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Could not listen on " << path << ", error = " << strerror(errno) << std::endl;
+        close(listener);
+        return false;
+    }
+
+    std::cerr << "Serving jobs on " << path << " with " << pool.size() << " threads" << std::endl;
+
+    // poll with a timeout, so that a shutdown request gets noticed
+    while (!stopping) {
+        pollfd waiting = { listener, POLLIN, 0 };
+        int ready = poll(&waiting, 1, 200);
+        if (ready <= 0)
+            continue;
+
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+
+        // a long running server sees any number of clients come and go
+        joinReaders(false);
+
+        std::lock_guard<std::mutex> guard(readersLock);
+        readers.push_back(Reader());
+        Reader &reader = readers.back();
+        reader.socket = client;
+        reader.done = false;
+        reader.thread = std::thread(&JobServer::readConnection, this, &reader);
+    }
+
+    close(listener);
+    unlink(path.c_str());
+
+    // wake up the readers still blocked on their clients
+    {
+        std::lock_guard<std::mutex> guard(readersLock);
+        for (std::list<Reader>::iterator i = readers.begin(); i != readers.end(); ++i)
+            if (!i->done)
+                shutdown(i->socket, SHUT_RD);
+    }
+    joinReaders(true);
+
+    pool.wait();
+    return true;
+}
+
+int runJobClient(const std::string &path, std::istream &in, std::ostream &out) {
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path " << path << " is too long" << std::endl;
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (sockaddr*)&address, sizeof(address)) != 0) {
+        std::cerr << "Could not connect to " << path << ", error = " << strerror(errno) << std::endl;
+        if (server >= 0)
+            close(server);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // answers are copied out as they arrive, while the requests go in
+    std::thread receiver([server, &out] {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(server, buffer, sizeof(buffer))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            out.write(buffer, n);
+            out.flush();
+        }
+    });
+
+    std::string line;
+    while (std::getline(in, line)) {
+        line += "\n";
+        for (size_t sent = 0; sent < line.size(); ) {
+            ssize_t n = write(server, line.data() + sent, line.size() - sent);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+    }
+    shutdown(server, SHUT_WR);  // tells the server we're done, it closes once everything is answered
+
+    receiver.join();
+    close(server);
+    return 0;
+}
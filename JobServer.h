@@ -0,0 +1,161 @@
+// Header file for the job server, the long running mode of the program.
+// jobs come in as one JSON object per line, on stdin or on a unix domain socket:
+//
+//   {"id": 7, "input": "in.png", "output": "out.gif", "compression": "smallest",
+//    "ops": ["inverse", {"op": "floydSteinberg", "colors": 16, "space": "oklab"}]}
+//
+// ops are the Image operations by name(greyscaleRed, greyscaleGreen,
+// greyscaleBlue, inverse, toBitmap, reducePalette, floydSteinberg,
+// gaussianBlur, boxBlur, unsharpMask, convolve, resize). the palette ops take
+// either an explicit "palette" of [r, g, b(, a)] entries or a number of
+// "colors"(a power of two) picked by median cut, plus an optional color
+// "space"(srgb, linear, lab or oklab). median cut can be given a "preview"
+// size to pick the palette from a downscaled copy no larger than that. the
+// filters take "sigma", "radius", "amount" and "threshold" like their methods
+// do, convolve takes a square "kernel" of rows. resize takes a "width", a
+// "height" or both(one alone keeps the aspect ratio) and a "filter"(nearest,
+// bilinear, bicubic or lanczos3, the default). output ends paletted when the
+// last op was a palette op.
+//
+// every job gets one line back with the same id, "ok", and how many
+// milliseconds it spent queued, decoding, processing and encoding. jobs run
+// concurrently, so the answers can come back in any order. {"cmd": "stats"}
+// reports the cache counters and {"cmd": "shutdown"} stops the server.
+//
+// decoded images and median cut palettes are cached across jobs, and a job
+// is only handed to a worker once the pixels it will need fit in the memory
+// budget(jobs that fit can start ahead of a bigger one that doesn't, a few times)
+
+#ifndef JOB_SERVER_H
+#define JOB_SERVER_H
+
+#include "Image.h"
+#include "Json.h"
+#include "ThreadPool.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <iosfwd>
+
+struct ServerOptions {
+    int threads;                 // jobs run at once, 0 for one per core
+    size_t memoryLimit;          // bytes of pixels the running jobs may hold between them
+    size_t imageCacheBytes;      // decoded images kept for later jobs
+    size_t paletteCacheEntries;  // median cut palettes kept for later jobs
+
+    ServerOptions() : threads(0), memoryLimit((size_t)1 << 30),
+                      imageCacheBytes((size_t)512 << 20), paletteCacheEntries(256) {}
+};
+
+class JobServer {
+private:
+    struct Connection;  // where the answers for one client go
+    struct Job;         // a parsed request
+
+    // the thread reading a client's requests, joined by the next accept once done
+    struct Reader {
+        std::thread thread;
+        int socket;
+        bool done;  // guarded by readersLock
+    };
+
+    // a decoded input, shared by every job that reads the same file. jobs that
+    // ask for it while it is still being decoded wait on the future
+    struct CachedImage {
+        std::shared_future<std::shared_ptr<Image> > image;  // null when decoding failed
+        size_t bytes;                                        // 0 while decoding
+        std::list<std::string>::iterator order;
+        unsigned long generation;  // tells it from an entry for the same key made later
+    };
+
+    // same for palettes, a job that needs one being picked by another waits for it
+    struct CachedPalette {
+        std::shared_future<std::vector<pixel> > palette;
+        std::list<std::string>::iterator order;
+        unsigned long generation;
+    };
+
+    ServerOptions options;
+
+    std::mutex cacheLock;  // guards both caches
+    std::map<std::string, CachedImage> images;
+    std::list<std::string> imageOrder;    // most recently used first
+    size_t cachedBytes;
+    std::map<std::string, CachedPalette> palettes;
+    std::list<std::string> paletteOrder;  // most recently used first
+    unsigned long generations;            // entries made so far
+
+    // jobs waiting for a free worker and room in the memory budget, in the
+    // order they came in
+    struct Waiting {
+        std::shared_ptr<Job> job;
+        std::shared_ptr<Connection> connection;
+    };
+
+    std::mutex memoryLock;  // guards the budget and the jobs waiting on it
+    size_t memoryInUse;
+    std::deque<Waiting> waiting;
+    size_t running;    // jobs handed to the pool
+    size_t overtaken;  // jobs started ahead of waiting.front()
+
+    std::atomic<unsigned long> jobsDone, jobsFailed;
+    std::atomic<unsigned long> imageHits, imageMisses, paletteHits, paletteMisses;
+
+    std::atomic<bool> stopping;
+    std::mutex readersLock;
+    std::list<Reader> readers;  // connections still being read, or not joined yet
+
+    // declared last, so the workers are joined before anything they use goes away
+    ThreadPool pool;
+
+    void handleLine(const std::string &line, const std::shared_ptr<Connection> &connection);
+    bool parseJob(const JsonValue &request, Job &job, std::string &error);
+    bool planJob(Job &job, std::string &error);
+    void runJob(const std::shared_ptr<Job> &job, const std::shared_ptr<Connection> &connection);
+    std::string stats();
+
+    bool process(const Job &job, const std::string &key, Image &source,
+                 std::chrono::steady_clock::time_point &processed, std::string &error);
+
+    template <class Entry>
+    void forget(const std::string &key, unsigned long generation, std::map<std::string, Entry> &cache,
+                std::list<std::string> &order);
+    std::shared_ptr<Image> decoded(const std::string &key, const std::string &filename, bool &hit);
+    bool peekSize(const std::string &key, int &width, int &height);
+    std::vector<pixel> medianCutPalette(const std::string &key, Image &image, int colors, ColorSpace space);
+
+    void admit(const std::shared_ptr<Job> &job, const std::shared_ptr<Connection> &connection);
+    void dispatch();
+    void release(size_t bytes);
+
+    void readConnection(Reader *reader);
+    void joinReaders(bool all);
+
+    JobServer(const JobServer&) = delete;
+    JobServer& operator=(const JobServer&) = delete;
+public:
+    explicit JobServer(const ServerOptions &options = ServerOptions());
+    ~JobServer();
+
+    // read jobs from in till it ends(or a shutdown comes in) and write the
+    // answers to out, returns once every job has finished
+    void serveStream(std::istream &in, std::ostream &out);
+
+    // accept clients on a unix domain socket at the given path till a
+    // shutdown comes in, returns false if the socket couldn't be set up
+    bool serveSocket(const std::string &path);
+};
+
+// the other end for testing: sends every line of in to the server listening
+// on the socket and copies the answers to out, returns a process exit code
+int runJobClient(const std::string &path, std::istream &in, std::ostream &out);
+
+#endif
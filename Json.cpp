@@ -0,0 +1,314 @@
+/*
+  recursive descent JSON parser and writer, see Json.h
+*/
+
+#include "Json.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <cmath>
+
+#define JSON_MAX_DEPTH 64  // nesting limit, so bad input can't blow the stack
+
+const JsonValue* JsonValue::get(const std::string &key) const {
+
+    if (type != OBJECT)
+        return nullptr;
+
+    for (size_t i = 0; i < members.size(); ++i)
+        if (members[i].first == key)
+            return &members[i].second;
+
+    return nullptr;
+}
+
+std::string jsonQuote(const std::string &text) {
+
+    std::string out = "\"";
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = text[i];
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                }
+                else
+                    out += c;
+        }
+    }
+    out += "\"";
+
+    return out;
+}
+
+std::string JsonValue::dump() const {
+
+    switch (type) {
+        case BOOLEAN:
+            return boolean ? "true" : "false";
+        case NUMBER: {
+            if (!std::isfinite(number))
+                return "null";  // JSON has no way to write these
+            char text[32];
+            snprintf(text, sizeof(text), "%.17g", number);
+            return text;
+        }
+        case STRING:
+            return jsonQuote(string);
+        case ARRAY: {
+            std::string out = "[";
+            for (size_t i = 0; i < array.size(); ++i)
+                out += (i ? "," : "") + array[i].dump();
+            return out + "]";
+        }
+        case OBJECT: {
+            std::string out = "{";
+            for (size_t i = 0; i < members.size(); ++i)
+                out += (i ? "," : "") + jsonQuote(members[i].first) + ":" + members[i].second.dump();
+            return out + "}";
+        }
+        default:
+            return "null";
+    }
+}
+
+// keeps track of where we are in the text being parsed
+struct JsonParser {
+    const std::string &text;
+    size_t at;
+    std::string error;
+
+    explicit JsonParser(const std::string &text) : text(text), at(0) {}
+
+    bool fail(const std::string &message) {
+        if (error.empty())
+            error = message + " at offset " + std::to_string(at);
+        return false;
+    }
+
+    void skipSpace() {
+        while (at < text.size() && (text[at] == ' ' || text[at] == '\t' ||
+                                    text[at] == '\n' || text[at] == '\r'))
+            at++;
+    }
+
+    bool literal(const char *word) {
+        size_t length = strlen(word);
+        if (text.compare(at, length, word) != 0)
+            return fail("unexpected character");
+        at += length;
+        return true;
+    }
+
+    // the 4 hex digits of a \u escape
+    bool hex4(unsigned &code) {
+        if (at + 4 > text.size())
+            return fail("truncated \\u escape");
+        code = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = text[at++];
+            code <<= 4;
+            if (c >= '0' && c <= '9') code |= c - '0';
+            else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+            else return fail("bad \\u escape");
+        }
+        return true;
+    }
+
+    static void appendUtf8(std::string &out, unsigned code) {
+        if (code < 0x80)
+            out += (char)code;
+        else if (code < 0x800) {
+            out += (char)(0xc0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000) {
+            out += (char)(0xe0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        }
+        else {
+            out += (char)(0xf0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3f));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        }
+    }
+
+    bool parseString(std::string &out) {
+        at++;  // opening quote
+        while (at < text.size()) {
+            char c = text[at++];
+            if (c == '"')
+                return true;
+            if ((unsigned char)c < 0x20)
+                return fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (at >= text.size())
+                break;
+            switch (text[at++]) {
+                case '"':  out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/'; break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    unsigned code;
+                    if (!hex4(code))
+                        return false;
+                    // a surrogate pair spells out one code point above 0xffff
+                    if (code >= 0xd800 && code < 0xdc00 && text.compare(at, 2, "\\u") == 0) {
+                        unsigned low;
+                        at += 2;
+                        if (!hex4(low))
+                            return false;
+                        if (low < 0xdc00 || low >= 0xe000)
+                            return fail("bad surrogate pair");
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default:
+                    return fail("bad escape");
+            }
+        }
+        return fail("unterminated string");
+    }
+
+    bool parseNumber(double &number) {
+        size_t start = at;
+        if (text[at] == '-')
+            at++;
+        if (at >= text.size() || !isdigit((unsigned char)text[at]))
+            return fail("bad number");
+        while (at < text.size() && (isdigit((unsigned char)text[at]) || text[at] == '.' ||
+                                    text[at] == 'e' || text[at] == 'E' || text[at] == '+' || text[at] == '-'))
+            at++;
+
+        std::string digits = text.substr(start, at - start);
+        char *end;
+        number = strtod(digits.c_str(), &end);
+        if (*end != '\0')
+            return fail("bad number");
+        return true;
+    }
+
+    bool parseValue(JsonValue &value, int depth) {
+
+        if (depth > JSON_MAX_DEPTH)
+            return fail("nested too deep");
+
+        skipSpace();
+        if (at >= text.size())
+            return fail("unexpected end of input");
+
+        char c = text[at];
+        if (c == '{') {
+            value.type = JsonValue::OBJECT;
+            at++;
+            skipSpace();
+            if (at < text.size() && text[at] == '}') {
+                at++;
+                return true;
+            }
+            for (;;) {
+                skipSpace();
+                if (at >= text.size() || text[at] != '"')
+                    return fail("expected a member name");
+                std::pair<std::string, JsonValue> member;
+                if (!parseString(member.first))
+                    return false;
+                skipSpace();
+                if (at >= text.size() || text[at] != ':')
+                    return fail("expected ':'");
+                at++;
+                if (!parseValue(member.second, depth + 1))
+                    return false;
+                value.members.push_back(std::move(member));
+                skipSpace();
+                if (at < text.size() && text[at] == ',') {
+                    at++;
+                    continue;
+                }
+                if (at < text.size() && text[at] == '}') {
+                    at++;
+                    return true;
+                }
+                return fail("expected ',' or '}'");
+            }
+        }
+        if (c == '[') {
+            value.type = JsonValue::ARRAY;
+            at++;
+            skipSpace();
+            if (at < text.size() && text[at] == ']') {
+                at++;
+                return true;
+            }
+            for (;;) {
+                value.array.push_back(JsonValue());
+                if (!parseValue(value.array.back(), depth + 1))
+                    return false;
+                skipSpace();
+                if (at < text.size() && text[at] == ',') {
+                    at++;
+                    continue;
+                }
+                if (at < text.size() && text[at] == ']') {
+                    at++;
+                    return true;
+                }
+                return fail("expected ',' or ']'");
+            }
+        }
+        if (c == '"') {
+            value.type = JsonValue::STRING;
+            return parseString(value.string);
+        }
+        if (c == 't' || c == 'f') {
+            value.type = JsonValue::BOOLEAN;
+            value.boolean = c == 't';
+            return literal(value.boolean ? "true" : "false");
+        }
+        if (c == 'n') {
+            value.type = JsonValue::NUL;
+            return literal("null");
+        }
+
+        value.type = JsonValue::NUMBER;
+        return parseNumber(value.number);
+    }
+};
+
+bool parseJson(const std::string &text, JsonValue &value, std::string &error) {
+
+    JsonParser parser(text);
+    value = JsonValue();
+
+    bool ok = parser.parseValue(value, 0);
+    if (ok) {
+        parser.skipSpace();
+        if (parser.at != text.size())
+            ok = parser.fail("trailing characters");
+    }
+
+    if (!ok)
+        error = parser.error;
+    return ok;
+}
@@ -0,0 +1,45 @@
+// Header file for the small JSON reader/writer used by the job server.
+// only what the job protocol needs: one value per line of text, numbers are
+// doubles and objects keep their members in the order they were written
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+class JsonValue {
+public:
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue> > members;  // OBJECT
+
+    JsonValue() : type(NUL), boolean(false), number(0) {}
+
+    bool isString() const { return type == STRING; }
+    bool isNumber() const { return type == NUMBER; }
+    bool isArray() const  { return type == ARRAY; }
+    bool isObject() const { return type == OBJECT; }
+
+    // the member with the given key, or null if this is not an object or
+    // doesn't have it
+    const JsonValue* get(const std::string &key) const;
+
+    // the value written back as compact JSON
+    std::string dump() const;
+};
+
+// parse a complete JSON text, returns false and describes the problem in
+// error if it isn't valid
+bool parseJson(const std::string &text, JsonValue &value, std::string &error);
+
+// the string as a quoted JSON string literal
+std::string jsonQuote(const std::string &text);
+
+#endif
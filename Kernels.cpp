@@ -0,0 +1,215 @@
+/*
+  the scalar build of the pixel kernels(compiled without auto vectorization)
+  and the dispatch between the different builds
+*/
+
+#include "KernelsImpl.h"
+#include <iostream>
+#include <random>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+
+static const KernelTable table = KERNEL_TABLE("scalar");
+const KernelTable *const scalarKernels = &table;
+
+// can the cpu we are running on execute the given build
+static bool supported(const KernelTable *kernels) {
+
+    if (!kernels)
+        return false;
+    if (kernels == scalarKernels)
+        return true;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (kernels == sse41Kernels)
+        return __builtin_cpu_supports("sse4.1");
+    if (kernels == avx2Kernels)
+        return __builtin_cpu_supports("avx2");
+    if (kernels == avx512Kernels)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vl");
+#endif
+
+    return false;
+}
+
+std::vector<const KernelTable*> availableKernels() {
+
+    const KernelTable *all[] = { scalarKernels, sse41Kernels, avx2Kernels, avx512Kernels };
+
+    std::vector<const KernelTable*> available;
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i)
+        if (supported(all[i]))
+            available.push_back(all[i]);
+
+    return available;
+}
+
+static const KernelTable* selectKernels() {
+
+    std::vector<const KernelTable*> available = availableKernels();
+
+    const char *forced = getenv("IP_KERNELS");
+    if (forced && *forced) {
+        for (size_t i = 0; i < available.size(); ++i)
+            if (strcmp(available[i]->name, forced) == 0)
+                return available[i];
+        std::cerr << "IP_KERNELS=" << forced << " is not available on this cpu, using "
+                  << available.back()->name << std::endl;
+    }
+
+    return available.back();  // the widest one
+}
+
+const KernelTable& kernels() {
+    static const KernelTable *chosen = selectKernels();
+    return *chosen;
+}
+
+// compare the output of one build against the scalar build, returns the
+// name of the first kernel that disagrees or null
+static const char* compareKernels(const KernelTable &test, std::mt19937 &rng) {
+
+    const KernelTable &reference = *scalarKernels;
+    const size_t n = 1000 + rng() % 100;  // not a multiple of any vector width
+
+    std::vector<unsigned char> input(4 * n), a(4 * n), b(4 * n);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = rng();
+
+    reference.expandGrey(input.data(), a.data(), n);
+    test.expandGrey(input.data(), b.data(), n);
+    if (a != b) return "expandGrey";
+
+    reference.expandRGB(input.data(), a.data(), n);
+    test.expandRGB(input.data(), b.data(), n);
+    if (a != b) return "expandRGB";
+
+    reference.expandGreyAlpha(input.data(), a.data(), n);
+    test.expandGreyAlpha(input.data(), b.data(), n);
+    if (a != b) return "expandGreyAlpha";
+
+    int source[3] = { (int)(rng() % 3), (int)(rng() % 3), (int)(rng() % 3) };
+    unsigned char lut[3][256];
+    for (int c = 0; c < 3; ++c)
+        for (int v = 0; v < 256; ++v)
+            lut[c][v] = rng();
+    a = input;
+    b = input;
+    reference.applyLut(a.data(), n, source, lut);
+    test.applyLut(b.data(), n, source, lut);
+    if (a != b) return "applyLut";
+
+    // a palette with duplicate entries, so that ties get exercised too
+    int ncolors = 1 + rng() % 100;
+    std::vector<unsigned char> palette(4 * ncolors);
+    std::vector<float> c0(ncolors), c1(ncolors), c2(ncolors);
+    for (int j = 0; j < ncolors; ++j) {
+        int from = j > 0 && rng() % 4 == 0 ? (int)(rng() % j) : j;
+        for (int c = 0; c < 4; ++c)
+            palette[4*j + c] = from == j ? (unsigned char)rng() : palette[4*from + c];
+        c0[j] = palette[4*j];
+        c1[j] = palette[4*j + 1];
+        c2[j] = palette[4*j + 2];
+    }
+
+    std::vector<float> points(3 * n);
+    for (size_t i = 0; i < points.size(); ++i)
+        points[i] = (float)(rng() % 25600) / 100.0f;
+    std::vector<int> ia(n), ib(n);
+    reference.nearest(points.data(), n, c0.data(), c1.data(), c2.data(), ncolors, ia.data());
+    test.nearest(points.data(), n, c0.data(), c1.data(), c2.data(), ncolors, ib.data());
+    if (ia != ib) return "nearest";
+
+    // two rows of n / 2 pixels each
+    int width = (int)(n / 2);
+    a = input;
+    b = input;
+    reference.ditherRow(a.data(), a.data() + 4 * width, width, palette.data(),
+                        c0.data(), c1.data(), c2.data(), ncolors, ia.data());
+    test.ditherRow(b.data(), b.data() + 4 * width, width, palette.data(),
+                   c0.data(), c1.data(), c2.data(), ncolors, ib.data());
+    if (a != b || ia != ib) return "ditherRow";
+
+    // a kernel with negative lobes, over rows that clip at both ends
+    int taps = 1 + 2 * (rng() % 8);
+    std::vector<short> weights(taps);
+    for (int k = 0; k < taps; ++k)
+        weights[k] = (short)((int)(rng() % 12000) - 4000);
+    size_t span = 4 * (n - taps);
+    std::vector<short> sa(span), sb(span);
+    reference.convolveRow(input.data(), sa.data(), span, weights.data(), taps);
+    test.convolveRow(input.data(), sb.data(), span, weights.data(), taps);
+    if (sa != sb) return "convolveRow";
+
+    std::vector<std::vector<short> > rows(taps, std::vector<short>(span));
+    std::vector<const short*> pointers(taps);
+    for (int k = 0; k < taps; ++k) {
+        for (size_t i = 0; i < span; ++i)
+            rows[k][i] = (short)((int)(rng() % 8000) - 2000);
+        pointers[k] = rows[k].data();
+    }
+    reference.convolveColumn(pointers.data(), a.data(), span, weights.data(), taps);
+    test.convolveColumn(pointers.data(), b.data(), span, weights.data(), taps);
+    if (a != b) return "convolveColumn";
+
+    // windows that start anywhere in the row, some overlapping the same pixels
+    int outWidth = (int)(span / 4) / 3;
+    std::vector<int> starts(outWidth);
+    std::vector<short> resampleWeights(4 * (size_t)outWidth * taps);
+    for (int x = 0; x < outWidth; ++x) {
+        starts[x] = rng() % (n - taps);
+        for (int k = 0; k < 4 * taps; ++k)
+            resampleWeights[4 * (size_t)x * taps + k] = weights[(k / 4 + x) % taps];
+    }
+    std::vector<short> ra(4 * outWidth), rb(4 * outWidth);
+    reference.resampleRow(input.data(), ra.data(), outWidth, starts.data(), resampleWeights.data(), taps);
+    test.resampleRow(input.data(), rb.data(), outWidth, starts.data(), resampleWeights.data(), taps);
+    if (ra != rb) return "resampleRow";
+
+    int amount = rng() % 1024, threshold = rng() % 16;
+    a = input;
+    b = input;
+    reference.sharpen(a.data(), input.data() + 4, n - 1, amount, threshold);
+    test.sharpen(b.data(), input.data() + 4, n - 1, amount, threshold);
+    if (a != b) return "sharpen";
+
+    return nullptr;
+}
+
+bool kernelSelfCheck(std::ostream &out) {
+
+    std::vector<const KernelTable*> available = availableKernels();
+    std::mt19937 rng(12345);
+    bool ok = true;
+
+    for (size_t i = 0; i < available.size(); ++i) {
+        const char *failed = nullptr;
+        for (int round = 0; round < 20 && !failed; ++round)
+            failed = compareKernels(*available[i], rng);
+
+        out << available[i]->name << ": " << (failed ? std::string(failed) + " differs from scalar" : "ok")
+            << (available[i] == &kernels() ? " (selected)" : "") << "\n";
+        ok = ok && !failed;
+    }
+
+    // a grey + alpha image, read from a buffer of exactly its own size like
+    // the one a decode leaves behind
+    const size_t pixels = 333;
+    std::vector<unsigned char> greyAlpha(2 * pixels), rgba(4 * pixels);
+    for (size_t i = 0; i < greyAlpha.size(); ++i)
+        greyAlpha[i] = rng();
+    for (size_t i = 0; i < available.size(); ++i) {
+        available[i]->expandGreyAlpha(greyAlpha.data(), rgba.data(), pixels);
+        bool same = true;
+        for (size_t p = 0; p < pixels; ++p)
+            same = same && rgba[4*p] == greyAlpha[2*p] && rgba[4*p + 1] == greyAlpha[2*p] &&
+                   rgba[4*p + 2] == greyAlpha[2*p] && rgba[4*p + 3] == greyAlpha[2*p + 1];
+        out << available[i]->name << " grey + alpha: " << (same ? "ok" : "failed") << "\n";
+        ok = ok && same;
+    }
+
+    return ok;
+}
@@ -0,0 +1,78 @@
+// Header file for the hot pixel loops.
+// every kernel is compiled several times, once per instruction set
+// (scalar, SSE4.1, AVX2 and AVX-512), and the best one the cpu supports is
+// picked the first time kernels() is called. the choice can be forced with the
+// IP_KERNELS environment variable(scalar, sse41, avx2 or avx512) for testing,
+// and kernelSelfCheck() makes sure every variant gives the same bytes
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <vector>
+
+struct KernelTable {
+    const char *name;
+
+    // channel conversion into RGBA, n is the number of pixels
+    void (*expandGrey)(const unsigned char *grey, unsigned char *rgba, size_t n);
+    void (*expandRGB)(const unsigned char *rgb, unsigned char *rgba, size_t n);
+    void (*expandGreyAlpha)(const unsigned char *greyAlpha, unsigned char *rgba, size_t n);
+
+    // point operation: rgb[c] = lut[c][rgb[source[c]]], alpha is left alone
+    void (*applyLut)(unsigned char *rgba, size_t n, const int source[3], const unsigned char lut[3][256]);
+
+    // index of the closest palette entry(stored channel by channel in
+    // c0, c1 and c2) for each of the n points, given as xyz triples
+    void (*nearest)(const float *points, size_t n, const float *c0, const float *c1,
+                    const float *c2, int ncolors, int *indices);
+
+    // one scanline of sRGB floyd-steinberg: quantizes row[1 .. width - 2] to the
+    // palette(rgba bytes plus its channel by channel float copy) and spreads the
+    // error to the rest of the row and to next. the palette index each of those
+    // pixels got goes to the same place in indices
+    void (*ditherRow)(unsigned char *row, unsigned char *next, int width,
+                      const unsigned char *palette, const float *c0, const float *c1,
+                      const float *c2, int ncolors, int *indices);
+
+    // the two passes of a separable convolution over RGBA bytes, with the
+    // weights in Q12 fixed point. the horizontal one reads n + 4 * (taps - 1)
+    // bytes of in and writes n Q4 values, out[i] = sum of weights[k] * in[i + 4k].
+    // the vertical one sums the same element of taps of those rows and
+    // rounds back to bytes
+    void (*convolveRow)(const unsigned char *in, short *out, size_t n, const short *weights, int taps);
+    void (*convolveColumn)(const short *const *rows, unsigned char *out, size_t n,
+                           const short *weights, int taps);
+
+    // horizontal pass of a resize: output pixel x is the sum of taps source
+    // pixels from starts[x] on, weighted(Q12) by the 4 * taps values from
+    // weights[4 * taps * x], every weight repeated for the four channels.
+    // written as Q4 values for convolveColumn to finish vertically
+    void (*resampleRow)(const unsigned char *in, short *out, int outWidth, const int *starts,
+                        const short *weights, int taps);
+
+    // unsharp masking of RGBA bytes against their blurred copy: colors move
+    // away from the blur by amount / 256 of the difference, unless that
+    // difference is below threshold. alpha is left alone
+    void (*sharpen)(unsigned char *rgba, const unsigned char *blurred, size_t n, int amount, int threshold);
+};
+
+// the variant chosen for this cpu
+const KernelTable& kernels();
+
+// every variant this cpu can run, scalar first
+std::vector<const KernelTable*> availableKernels();
+
+// run every available variant against the scalar one on random data, reports
+// mismatches on the given stream and returns true when they all agree
+bool kernelSelfCheck(std::ostream &out);
+
+// defined by the per instruction set translation units, null when the
+// compiler could not target that instruction set
+extern const KernelTable *const scalarKernels;
+extern const KernelTable *const sse41Kernels;
+extern const KernelTable *const avx2Kernels;
+extern const KernelTable *const avx512Kernels;
+
+#endif
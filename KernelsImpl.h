@@ -0,0 +1,250 @@
+/*
+  bodies of the pixel kernels, included by Kernels.cpp and by each of the
+  per instruction set files, which are compiled with their own -m flags.
+
+  these are written as plain loops over contiguous arrays that the compiler
+  can vectorize for whatever instruction set it is targeting. nothing from
+  the standard library may be used in here: its inline functions are shared
+  between translation units, and the linker could end up keeping the AVX-512
+  copy of one for the whole program.
+*/
+
+#ifndef KERNELS_IMPL_H
+#define KERNELS_IMPL_H
+
+#include "Kernels.h"
+
+#define KERNEL_BLOCK 64    // points matched together by nearestImpl
+#define KERNEL_FLT_MAX 3.402823466e+38f
+#define KERNEL_CONV_BLOCK 256  // bytes convolved together
+
+static void expandGreyImpl(const unsigned char *grey, unsigned char *rgba, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        rgba[4*i] = grey[i];
+        rgba[4*i + 1] = grey[i];
+        rgba[4*i + 2] = grey[i];
+        rgba[4*i + 3] = 255;
+    }
+}
+
+static void expandRGBImpl(const unsigned char *rgb, unsigned char *rgba, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        rgba[4*i] = rgb[3*i];
+        rgba[4*i + 1] = rgb[3*i + 1];
+        rgba[4*i + 2] = rgb[3*i + 2];
+        rgba[4*i + 3] = 255;
+    }
+}
+
+static void expandGreyAlphaImpl(const unsigned char *greyAlpha, unsigned char *rgba, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        rgba[4*i] = greyAlpha[2*i];
+        rgba[4*i + 1] = greyAlpha[2*i];
+        rgba[4*i + 2] = greyAlpha[2*i];
+        rgba[4*i + 3] = greyAlpha[2*i + 1];
+    }
+}
+
+static void applyLutImpl(unsigned char *rgba, size_t n, const int source[3], const unsigned char lut[3][256]) {
+
+    int s0 = source[0], s1 = source[1], s2 = source[2];
+    const unsigned char *l0 = lut[0], *l1 = lut[1], *l2 = lut[2];
+
+    for (size_t i = 0; i < n; ++i, rgba += 4) {
+        unsigned char r = l0[rgba[s0]], g = l1[rgba[s1]], b = l2[rgba[s2]];
+        rgba[0] = r;
+        rgba[1] = g;
+        rgba[2] = b;
+    }
+}
+
+// points are matched a block at a time, looping over the palette on the
+// outside so that the inner loop runs across independent points. ties go to
+// the lower palette index, same as a plain search
+static void nearestImpl(const float *points, size_t n, const float *c0, const float *c1,
+                        const float *c2, int ncolors, int *indices) {
+
+    // the winning index is kept as a float, so both selects below work on
+    // lanes of the same width
+    float x[KERNEL_BLOCK], y[KERNEL_BLOCK], z[KERNEL_BLOCK], best[KERNEL_BLOCK];
+    float index[KERNEL_BLOCK];
+
+    for (size_t start = 0; start < n; start += KERNEL_BLOCK) {
+        int count = n - start < KERNEL_BLOCK ? (int)(n - start) : KERNEL_BLOCK;
+
+        for (int i = 0; i < count; ++i) {
+            x[i] = points[3 * (start + i)];
+            y[i] = points[3 * (start + i) + 1];
+            z[i] = points[3 * (start + i) + 2];
+            best[i] = KERNEL_FLT_MAX;
+            index[i] = -1.0f;
+        }
+
+        for (int j = 0; j < ncolors; ++j) {
+            float p0 = c0[j], p1 = c1[j], p2 = c2[j], fj = (float)j;
+            for (int i = 0; i < count; ++i) {
+                float d0 = p0 - x[i];
+                float d1 = p1 - y[i];
+                float d2 = p2 - z[i];
+                float diff = d0 * d0 + d1 * d1 + d2 * d2;
+                float closest = best[i], k = index[i];
+                bool closer = diff < closest;
+                index[i] = closer ? fj : k;
+                best[i] = closer ? diff : closest;
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+            indices[start + i] = (int)index[i];
+    }
+}
+
+static inline unsigned char capImpl(int value) {
+    return (unsigned char)(value > 255 ? 255 : value < 0 ? 0 : value);
+}
+
+static inline short clamp16Impl(int value) {
+    return (short)(value > 32767 ? 32767 : value < -32768 ? -32768 : value);
+}
+
+static void ditherRowImpl(unsigned char *row, unsigned char *next, int width,
+                          const unsigned char *palette, const float *c0, const float *c1,
+                          const float *c2, int ncolors, int *indices) {
+
+    float dist[KERNEL_BLOCK];
+
+    for (int w = 1; w < width - 1; ++w) {
+        unsigned char *old = row + 4 * w;
+        float r = old[0], g = old[1], b = old[2];
+
+        // distances to a block of palette entries at a time(vectorizes),
+        // then a scalar pass to pick the first smallest
+        float smallest = KERNEL_FLT_MAX;
+        int palette_index = -1;
+        for (int start = 0; start < ncolors; start += KERNEL_BLOCK) {
+            int count = ncolors - start < KERNEL_BLOCK ? ncolors - start : KERNEL_BLOCK;
+            for (int j = 0; j < count; ++j) {
+                float d0 = c0[start + j] - r;
+                float d1 = c1[start + j] - g;
+                float d2 = c2[start + j] - b;
+                dist[j] = d0 * d0 + d1 * d1 + d2 * d2;
+            }
+            for (int j = 0; j < count; ++j) {
+                if (dist[j] < smallest) {
+                    smallest = dist[j];
+                    palette_index = start + j;
+                }
+            }
+        }
+
+        indices[w] = palette_index;
+        const unsigned char *color = palette + 4 * palette_index;
+        int qer = old[0] - color[0];
+        int qeg = old[1] - color[1];
+        int qeb = old[2] - color[2];
+        old[0] = color[0];
+        old[1] = color[1];
+        old[2] = color[2];
+        old[3] = color[3];
+
+        unsigned char *right = old + 4;
+        right[0] = capImpl(right[0] + qer * 7/16);
+        right[1] = capImpl(right[1] + qeg * 7/16);
+        right[2] = capImpl(right[2] + qeb * 7/16);
+
+        unsigned char *below = next + 4 * (w - 1);
+        below[0] = capImpl(below[0] + qer * 3/16);
+        below[1] = capImpl(below[1] + qeg * 3/16);
+        below[2] = capImpl(below[2] + qeb * 3/16);
+        below[4] = capImpl(below[4] + qer * 5/16);
+        below[5] = capImpl(below[5] + qeg * 5/16);
+        below[6] = capImpl(below[6] + qeb * 5/16);
+        below[8] = capImpl(below[8] + qer * 1/16);
+        below[9] = capImpl(below[9] + qeg * 1/16);
+        below[10] = capImpl(below[10] + qeb * 1/16);
+    }
+}
+
+// the taps are summed into a block of 32 bit accumulators, one tap at a time,
+// so the inner loop is a widening multiply-add across the block
+static void convolveRowImpl(const unsigned char *in, short *out, size_t n, const short *weights, int taps) {
+
+    int acc[KERNEL_CONV_BLOCK];
+
+    for (size_t start = 0; start < n; start += KERNEL_CONV_BLOCK) {
+        int count = n - start < KERNEL_CONV_BLOCK ? (int)(n - start) : KERNEL_CONV_BLOCK;
+        const unsigned char *src = in + start;
+
+        for (int i = 0; i < count; ++i)
+            acc[i] = 1 << 7;  // rounds the shift from Q12 down to Q4
+        for (int k = 0; k < taps; ++k) {
+            int w = weights[k];
+            const unsigned char *tap = src + 4 * k;
+            for (int i = 0; i < count; ++i)
+                acc[i] += w * tap[i];
+        }
+        for (int i = 0; i < count; ++i)
+            out[start + i] = clamp16Impl(acc[i] >> 8);
+    }
+}
+
+static void convolveColumnImpl(const short *const *rows, unsigned char *out, size_t n,
+                               const short *weights, int taps) {
+
+    int acc[KERNEL_CONV_BLOCK];
+
+    for (size_t start = 0; start < n; start += KERNEL_CONV_BLOCK) {
+        int count = n - start < KERNEL_CONV_BLOCK ? (int)(n - start) : KERNEL_CONV_BLOCK;
+
+        for (int i = 0; i < count; ++i)
+            acc[i] = 1 << 15;  // rounds the shift from Q16 down to bytes
+        for (int k = 0; k < taps; ++k) {
+            int w = weights[k];
+            const short *row = rows[k] + start;
+            for (int i = 0; i < count; ++i)
+                acc[i] += w * row[i];
+        }
+        for (int i = 0; i < count; ++i)
+            out[start + i] = capImpl(acc[i] >> 16);
+    }
+}
+
+// every output pixel has its own window, so the vectors run along the window:
+// the weights come repeated for each channel, the window's bytes are summed 16
+// at a time, and the four partial sums of each channel are added up at the end
+static void resampleRowImpl(const unsigned char *in, short *out, int outWidth, const int *starts,
+                            const short *weights, int taps) {
+
+    int n = 4 * taps;
+    for (int x = 0; x < outWidth; ++x) {
+        const unsigned char *src = in + 4 * starts[x];
+        const short *w = weights + (size_t)x * n;
+
+        int lanes[16] = { 0 };
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+            for (int l = 0; l < 16; ++l)
+                lanes[l] += w[i + l] * src[i + l];
+        for (; i < n; ++i)
+            lanes[i & 15] += w[i] * src[i];
+
+        for (int c = 0; c < 4; ++c)
+            out[4 * x + c] = clamp16Impl(((1 << 7) + lanes[c] + lanes[c + 4] + lanes[c + 8] + lanes[c + 12]) >> 8);
+    }
+}
+
+static void sharpenImpl(unsigned char *rgba, const unsigned char *blurred, size_t n, int amount, int threshold) {
+
+    for (size_t i = 0; i < 4 * n; ++i) {
+        int diff = rgba[i] - blurred[i];
+        int magnitude = diff < 0 ? -diff : diff;
+        int sharpened = rgba[i] + ((diff * amount + 128) >> 8);
+        bool keep = (i & 3) == 3 || magnitude < threshold;
+        rgba[i] = keep ? rgba[i] : capImpl(sharpened);
+    }
+}
+
+#define KERNEL_TABLE(name) { name, expandGreyImpl, expandRGBImpl, expandGreyAlphaImpl, applyLutImpl, nearestImpl, ditherRowImpl, \
+                             convolveRowImpl, convolveColumnImpl, resampleRowImpl, sharpenImpl }
+
+#endif
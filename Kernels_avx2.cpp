@@ -0,0 +1,19 @@
+/*
+  the AVX2 build of the pixel kernels, see the Makefile for the flags.
+  compilers that can't target AVX2 leave the table out
+*/
+
+#include "Kernels.h"
+
+#if defined(__AVX2__)
+
+#include "KernelsImpl.h"
+
+static const KernelTable table = KERNEL_TABLE("avx2");
+const KernelTable *const avx2Kernels = &table;
+
+#else
+
+const KernelTable *const avx2Kernels = nullptr;
+
+#endif
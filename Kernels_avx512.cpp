@@ -0,0 +1,19 @@
+/*
+  the AVX-512 build of the pixel kernels, see the Makefile for the flags.
+  compilers that can't target AVX-512 leave the table out
+*/
+
+#include "Kernels.h"
+
+#if defined(__AVX512BW__)
+
+#include "KernelsImpl.h"
+
+static const KernelTable table = KERNEL_TABLE("avx512");
+const KernelTable *const avx512Kernels = &table;
+
+#else
+
+const KernelTable *const avx512Kernels = nullptr;
+
+#endif
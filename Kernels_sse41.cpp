@@ -0,0 +1,19 @@
+/*
+  the SSE4.1 build of the pixel kernels, see the Makefile for the flags.
+  compilers that can't target SSE4.1 leave the table out
+*/
+
+#include "Kernels.h"
+
+#if defined(__SSE4_1__)
+
+#include "KernelsImpl.h"
+
+static const KernelTable table = KERNEL_TABLE("sse41");
+const KernelTable *const sse41Kernels = &table;
+
+#else
+
+const KernelTable *const sse41Kernels = nullptr;
+
+#endif
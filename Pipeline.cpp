@@ -0,0 +1,276 @@
+/*
+  the lazy pipeline.
+
+  every per pixel operation we have is of the form "copy one channel into the
+  others" or "remap each channel through a table", so any chain of them can be
+  folded into one channel selection plus one 256 entry table per channel.
+  a palette reduction ends the chain since its output can only be one of the
+  palette colors; everything after it is applied to those colors instead.
+
+  toBitmap only carries its error along the scanline, so it can run right
+  behind the fused point pass on the same band of rows while they are still
+  in cache. floyd-steinberg pushes error into the next row and runs on its own.
+*/
+
+#include "Pipeline.h"
+#include "RowSpan.h"
+#include "Kernels.h"
+#include <string.h>
+#include <cinttypes>
+#include <algorithm>
+
+#define L2_BYTES (256 * 1024)  // band size, small enough to stay in L2
+#define MATCH_CACHE_SIZE 4096  // direct mapped cache of palette matches
+
+Pipeline::PointStage::PointStage() : space(SPACE_SRGB) {
+    for (int c = 0; c < 3; ++c) {
+        source[c] = c;
+        for (int v = 0; v < 256; ++v)
+            lut[c][v] = v;
+    }
+}
+
+bool Pipeline::PointStage::identity() const {
+
+    if (!palette.empty())
+        return false;
+
+    for (int c = 0; c < 3; ++c) {
+        if (source[c] != c)
+            return false;
+        for (int v = 0; v < 256; ++v)
+            if (lut[c][v] != v)
+                return false;
+    }
+
+    return true;
+}
+
+Pipeline::PointStage& Pipeline::currentPoint() {
+
+    if (stages.empty() || stages.back().kind != POINT) {
+        stages.push_back(Stage());
+        stages.back().kind = POINT;
+    }
+
+    return stages.back().point;
+}
+
+// copy the given channel into the other two
+void Pipeline::swizzle(int channel) {
+
+    PointStage &stage = currentPoint();
+
+    if (!stage.palette.empty()) {
+        // past a palette reduction, just recolor the palette
+        for (size_t i = 0; i < stage.colors.size(); ++i) {
+            pixel &color = stage.colors[i];
+            unsigned char value = channel == 0 ? color.r : channel == 1 ? color.g : color.b;
+            color.r = color.g = color.b = value;
+        }
+        return;
+    }
+
+    int source = stage.source[channel];
+    unsigned char lut[256];
+    memcpy(lut, stage.lut[channel], 256);
+
+    for (int c = 0; c < 3; ++c) {
+        stage.source[c] = source;
+        memcpy(stage.lut[c], lut, 256);
+    }
+}
+
+Pipeline& Pipeline::inverse() {
+
+    PointStage &stage = currentPoint();
+
+    if (!stage.palette.empty()) {
+        for (size_t i = 0; i < stage.colors.size(); ++i) {
+            pixel &color = stage.colors[i];
+            color.r = 255 - color.r;
+            color.g = 255 - color.g;
+            color.b = 255 - color.b;
+        }
+    }
+    else {
+        for (int c = 0; c < 3; ++c)
+            for (int v = 0; v < 256; ++v)
+                stage.lut[c][v] = 255 - stage.lut[c][v];
+    }
+
+    return *this;
+}
+
+Pipeline& Pipeline::reducePalette(const std::vector<pixel> &palette, ColorSpace space) {
+
+    if (palette.empty())
+        return *this;
+
+    PointStage &stage = currentPoint();
+
+    if (!stage.palette.empty()) {
+        // already reduced once, the pixels can only be one of stage.colors,
+        // so match those against the new palette ahead of time
+        PaletteMatcher matcher(palette, space);
+        for (size_t i = 0; i < stage.colors.size(); ++i) {
+            const pixel &color = stage.colors[i];
+            stage.colors[i] = palette[matcher.closest(color.r, color.g, color.b)];
+        }
+    }
+    else {
+        stage.palette = palette;
+        stage.colors = palette;
+        stage.space = space;
+    }
+
+    return *this;
+}
+
+Pipeline& Pipeline::toBitmap() {
+    stages.push_back(Stage());
+    stages.back().kind = BITMAP;
+    return *this;
+}
+
+Pipeline& Pipeline::floydSteinberg(const std::vector<pixel> &palette, ColorSpace space) {
+    stages.push_back(Stage());
+    stages.back().kind = DITHER;
+    stages.back().palette = palette;
+    stages.back().space = space;
+    return *this;
+}
+
+size_t Pipeline::passes() const {
+
+    size_t count = 0;
+    for (size_t i = 0; i < stages.size(); ++i)
+        if (stages[i].kind == DITHER || i == 0 || stages[i - 1].kind == DITHER)
+            count++;
+
+    return count;
+}
+
+// state needed to run a fused point stage over any range of rows
+struct Pipeline::PointRunner {
+    const PointStage *stage;
+    bool skip;                            // nothing to do for this stage
+    bool paletted;
+    bool grey;                            // all 3 channels come from the same input channel
+    std::vector<int> greyMatch;           // palette index for each grey input value
+    std::vector<std::uint32_t> cacheKey;  // rgb of the cached match, with bit 24 set when valid
+    std::vector<int> cacheIndex;
+    PaletteMatcher matcher;
+
+    PointRunner(const Stage &s) :
+    stage(&s.point), skip(true), paletted(false), grey(false), matcher(s.point.palette, s.point.space)
+    {
+
+        if (s.kind != POINT || stage->identity())
+            return;
+
+        skip = false;
+        paletted = !stage->palette.empty();
+        grey = stage->source[0] == stage->source[1] && stage->source[1] == stage->source[2];
+        if (!paletted)
+            return;
+
+        if (grey) {
+            // only 256 colors can ever reach the palette match, do them all now
+            greyMatch.resize(256);
+            for (int v = 0; v < 256; ++v)
+                greyMatch[v] = matcher.closest(stage->lut[0][v], stage->lut[1][v], stage->lut[2][v]);
+        }
+        else {
+            cacheKey.assign(MATCH_CACHE_SIZE, 0);
+            cacheIndex.assign(MATCH_CACHE_SIZE, 0);
+        }
+    }
+
+    int match(unsigned char r, unsigned char g, unsigned char b) {
+
+        std::uint32_t key = (1u << 24) | ((std::uint32_t)r << 16) | ((std::uint32_t)g << 8) | b;
+        std::uint32_t slot = ((key * 2654435761u) >> 20) & (MATCH_CACHE_SIZE - 1);
+
+        if (cacheKey[slot] != key) {
+            cacheKey[slot] = key;
+            cacheIndex[slot] = matcher.closest(r, g, b);
+        }
+
+        return cacheIndex[slot];
+    }
+
+    void run(Image &image, int first, int last) {
+
+        if (skip)
+            return;
+
+        const unsigned char *lr = stage->lut[0], *lg = stage->lut[1], *lb = stage->lut[2];
+        int sr = stage->source[0], sg = stage->source[1], sb = stage->source[2];
+        const pixel *colors = stage->colors.data();
+        int width = image.getWidth();
+
+        if (!paletted) {
+            // the rows of a band are contiguous, one kernel call does them all
+            kernels().applyLut(image.row(first), (size_t)width * (last - first), stage->source, stage->lut);
+            return;
+        }
+
+        forEachRow(image, first, last, [&](const RowSpan &row) {
+            for (unsigned char *p = row.begin(); p != row.end(); p += 4) {
+                int index = grey ? greyMatch[p[sr]] : match(lr[p[sr]], lg[p[sg]], lb[p[sb]]);
+                const pixel &color = colors[index];
+                p[0] = color.r;
+                p[1] = color.g;
+                p[2] = color.b;
+                p[3] = color.a;
+            }
+        });
+    }
+};
+
+void Pipeline::run() {
+
+    int width = image.getWidth();
+    int height = image.getHeight();
+    size_t rowbytes = 4 * (size_t)width;
+
+    int band = (int)(L2_BYTES / (rowbytes ? rowbytes : 1));
+    if (band < 1)
+        band = 1;
+
+    size_t i = 0;
+    while (i < stages.size()) {
+
+        if (stages[i].kind == DITHER) {
+            image.floydSteinberg(stages[i].palette, stages[i].space);
+            i++;
+            continue;
+        }
+
+        // everything up to the next dither works a scanline at a time,
+        // so run the whole group one band of rows after the other
+        size_t end = i;
+        while (end < stages.size() && stages[end].kind != DITHER)
+            end++;
+
+        std::vector<PointRunner> runners;
+        for (size_t s = i; s < end; ++s)
+            runners.push_back(PointRunner(stages[s]));
+
+        for (int first = 0; first < height; first += band) {
+            int last = std::min(first + band, height);
+            for (size_t s = 0; s < runners.size(); ++s) {
+                if (stages[i + s].kind == BITMAP)
+                    image.toBitmap(first, last);
+                else
+                    runners[s].run(image, first, last);
+            }
+        }
+        image.markDirty();  // the point stages write every pixel
+
+        i = end;
+    }
+
+    stages.clear();
+}
@@ -0,0 +1,70 @@
+// Header file for the lazy operation pipeline.
+// operations are recorded instead of being run right away, and when the
+// pipeline is run every run of consecutive per pixel operations is fused into
+// a single pass over the pixmap. the results are exactly the same as calling
+// the Image methods one after the other
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "Image.h"
+#include <vector>
+
+class Pipeline {
+private:
+    // a run of per pixel operations collapsed into one mapping:
+    //   1. every output channel c is lut[c][input[source[c]]]
+    //   2. optionally, the result is matched against `palette` in `space`
+    //      and the pixel becomes colors[matched index]
+    // operations recorded after a palette reduction only ever see palette
+    // colors, so they are folded into `colors` instead of being run per pixel
+    struct PointStage {
+        int source[3];
+        unsigned char lut[3][256];
+        std::vector<pixel> palette;
+        std::vector<pixel> colors;
+        ColorSpace space;
+
+        PointStage();
+        bool identity() const;
+    };
+
+    enum StageKind { POINT, BITMAP, DITHER };
+
+    struct Stage {
+        StageKind kind;
+        PointStage point;              // POINT
+        std::vector<pixel> palette;    // DITHER
+        ColorSpace space;              // DITHER
+    };
+
+    struct PointRunner;  // runs a point stage over a band of rows
+
+    Image &image;
+    std::vector<Stage> stages;
+
+    PointStage& currentPoint();  // the point stage at the end, opening a new one if needed
+    void swizzle(int channel);
+public:
+    explicit Pipeline(Image &image) : image(image) {}
+
+    // per pixel operations, these get fused
+    Pipeline& greyscaleRed()   { swizzle(0); return *this; }
+    Pipeline& greyscaleGreen() { swizzle(1); return *this; }
+    Pipeline& greyscaleBlue()  { swizzle(2); return *this; }
+    Pipeline& inverse();
+    Pipeline& reducePalette(const std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
+
+    // operations that spread error to the neighbours, these split the fused passes
+    Pipeline& toBitmap();
+    Pipeline& floydSteinberg(const std::vector<pixel> &palette, ColorSpace space = SPACE_SRGB);
+
+    // number of passes over the pixmap that run() will make, every dither
+    // is one and so is every group of stages between them
+    size_t passes() const;
+
+    // apply everything recorded so far to the image and clear the pipeline
+    void run();
+};
+
+#endif
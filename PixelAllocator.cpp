@@ -0,0 +1,142 @@
+/*
+  size class pool for pixel buffers.
+
+  requests are rounded up to one of 4 classes per power of two
+  (1, 1.25, 1.5 and 1.75 times the power), which wastes at most 25% and lets
+  images of slightly different sizes share the same free list. the smallest
+  class is a page.
+
+  buffers can also be file mappings(the raw pixel cache), those are unmapped
+  rather than pooled.
+*/
+
+#include "PixelAllocator.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <new>
+
+#define MIN_CLASS_SHIFT 12   // 4 KiB
+#define STEPS_PER_OCTAVE 4
+#define NUM_OCTAVES 40
+
+// index of the size class that fits the given number of bytes
+static size_t classIndex(size_t bytes) {
+
+    size_t octave = 0;
+    size_t base = (size_t)1 << MIN_CLASS_SHIFT;
+    while (base * 2 <= bytes) {
+        base *= 2;
+        octave++;
+    }
+
+    // bytes is now in [base, 2 * base), find the first quarter step that holds it
+    size_t step = 0;
+    while (step < STEPS_PER_OCTAVE && base + step * (base / STEPS_PER_OCTAVE) < bytes)
+        step++;
+
+    return octave * STEPS_PER_OCTAVE + step;  // step == 4 is the next octave's first class
+}
+
+static size_t classSize(size_t index) {
+    size_t base = (size_t)1 << (MIN_CLASS_SHIFT + index / STEPS_PER_OCTAVE);
+    return base + (index % STEPS_PER_OCTAVE) * (base / STEPS_PER_OCTAVE);
+}
+
+PixelPool::PixelPool() :
+freelists(NUM_OCTAVES * STEPS_PER_OCTAVE + 1), cachedBytes(0),
+maxCachedBytes((size_t)256 << 20)
+{
+}
+
+// never destroyed, images living in globals may still hand their buffers
+// back while the program is shutting down
+PixelPool& PixelPool::instance() {
+    static PixelPool *pool = new PixelPool();
+    return *pool;
+}
+
+size_t PixelPool::roundUp(size_t bytes) {
+    return classSize(classIndex(bytes));
+}
+
+unsigned char* PixelPool::acquire(size_t bytes) {
+
+    size_t index = classIndex(bytes);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<void*> &list = freelists[index];
+        if (!list.empty()) {
+            void *buffer = list.back();
+            list.pop_back();
+            cachedBytes -= classSize(index);
+            return (unsigned char*)buffer;
+        }
+    }
+
+    // nothing idle in this class, get a fresh buffer from the system
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, PIXEL_ALIGNMENT, classSize(index)) != 0)
+        throw std::bad_alloc();
+
+    return (unsigned char*)buffer;
+}
+
+void PixelPool::release(unsigned char *buffer, size_t bytes) {
+
+    size_t index = classIndex(bytes);
+    size_t size = classSize(index);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (cachedBytes + size <= maxCachedBytes) {
+            freelists[index].push_back(buffer);
+            cachedBytes += size;
+            return;
+        }
+    }
+
+    free(buffer);  // the pool is full
+}
+
+void PixelPool::setCacheLimit(size_t bytes) {
+    bool over;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        maxCachedBytes = bytes;
+        over = cachedBytes > bytes;
+    }
+    if (over)
+        trim();
+}
+
+void PixelPool::trim() {
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < freelists.size(); ++i) {
+        for (size_t j = 0; j < freelists[i].size(); ++j)
+            free(freelists[i][j]);
+        freelists[i].clear();
+    }
+    cachedBytes = 0;
+}
+
+PixelBuffer PixelBuffer::mapFile(int fd, size_t offset, size_t bytes) {
+
+    PixelBuffer mapping;
+    if (bytes == 0)
+        return mapping;
+
+    // private and writable: the image can be edited like any other, the
+    // file never sees the changes
+    void *pages = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)offset);
+    if (pages == MAP_FAILED)
+        return mapping;
+
+    mapping.buffer = (unsigned char*)pages;
+    mapping.bytes = bytes;
+    mapping.mapped = true;
+    return mapping;
+}
+
+void PixelBuffer::unmap(unsigned char *buffer, size_t bytes) {
+    munmap(buffer, bytes);
+}
@@ -0,0 +1,97 @@
+// Header file for the allocator behind every pixel buffer.
+// buffers are 64 byte aligned(one cache line, wide enough for any simd load)
+// and are recycled through per size class free lists, so that the image we
+// allocate for every frame or every job reuses memory that is already mapped in
+
+#ifndef PIXEL_ALLOCATOR_H
+#define PIXEL_ALLOCATOR_H
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+#define PIXEL_ALIGNMENT 64
+
+class PixelPool {
+private:
+    std::vector<std::vector<void*> > freelists;  // one list of idle buffers per size class
+    std::mutex lock;
+    size_t cachedBytes;     // bytes sitting idle in the free lists
+    size_t maxCachedBytes;  // anything released beyond this goes back to the system
+
+    PixelPool();
+    PixelPool(const PixelPool&) = delete;
+    PixelPool& operator=(const PixelPool&) = delete;
+public:
+    static PixelPool& instance();
+
+    // the actual number of bytes handed out for a request of the given size
+    static size_t roundUp(size_t bytes);
+
+    unsigned char* acquire(size_t bytes);
+    void release(unsigned char *buffer, size_t bytes);  // bytes must match what was acquired
+
+    void setCacheLimit(size_t bytes);
+    void trim();  // give every idle buffer back to the system
+};
+
+// owns a single buffer from the pool, hands it back when it goes out of scope.
+// it can hold a mapping of a file instead, which gets unmapped
+class PixelBuffer {
+private:
+    unsigned char *buffer;
+    size_t bytes;
+    bool mapped;
+
+    static void unmap(unsigned char *buffer, size_t bytes);
+public:
+    PixelBuffer() : buffer(nullptr), bytes(0), mapped(false) {}
+    explicit PixelBuffer(size_t bytes) :
+        buffer(bytes ? PixelPool::instance().acquire(bytes) : nullptr), bytes(bytes), mapped(false) {}
+    ~PixelBuffer() { reset(); }
+
+    PixelBuffer(PixelBuffer &&other) noexcept :
+        buffer(other.buffer), bytes(other.bytes), mapped(other.mapped) {
+        other.buffer = nullptr;
+        other.bytes = 0;
+        other.mapped = false;
+    }
+    PixelBuffer& operator=(PixelBuffer &&other) noexcept {
+        if (this != &other) {
+            reset();
+            buffer = other.buffer;
+            bytes = other.bytes;
+            mapped = other.mapped;
+            other.buffer = nullptr;
+            other.bytes = 0;
+            other.mapped = false;
+        }
+        return *this;
+    }
+    PixelBuffer(const PixelBuffer&) = delete;
+    PixelBuffer& operator=(const PixelBuffer&) = delete;
+
+    // bytes of an open file from offset on(a multiple of the page size),
+    // mapped copy on write: the pages are shared with the page cache and every
+    // other mapping of the file until they are written to. empty when the
+    // file can't be mapped
+    static PixelBuffer mapFile(int fd, size_t offset, size_t bytes);
+
+    void reset() {
+        if (buffer) {
+            if (mapped)
+                unmap(buffer, bytes);
+            else
+                PixelPool::instance().release(buffer, bytes);
+        }
+        buffer = nullptr;
+        bytes = 0;
+        mapped = false;
+    }
+
+    unsigned char* data() const { return buffer; }
+    size_t size() const { return bytes; }
+    bool isMapped() const { return mapped; }
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*
+  the raw pixel cache, see RawCache.h for the layout.
+
+  failures are never errors here: an entry that can't be read or written just
+  means the source gets decoded like it would without the cache
+*/
+
+#include "RawCache.h"
+#include <string.h>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <time.h>
+
+#define STALE_WRITE_SECONDS 60  // a temporary file this old was left by a write that died
+
+// where the entries go, empty when the cache is off
+static std::string cacheDirectory() {
+    const char *configured = getenv("IP_RAW_CACHE");
+    return configured ? configured : "";
+}
+
+// bytes the entries may take up between them
+static uint64_t cacheBudget() {
+    const char *configured = getenv("IP_RAW_CACHE_MB");
+    long long megabytes = configured ? atoll(configured) : 0;
+    if (megabytes <= 0)
+        megabytes = RAW_CACHE_DEFAULT_MB;
+    return (uint64_t)megabytes << 20;
+}
+
+// 64 bit FNV-1a
+static uint64_t hashString(const std::string &text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < text.size(); ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int64_t modificationTime(const struct stat &info) {
+#ifdef __APPLE__
+    long nanoseconds = info.st_mtimespec.tv_nsec;
+#else
+    long nanoseconds = info.st_mtim.tv_nsec;
+#endif
+    return (int64_t)info.st_mtime * 1000000000 + nanoseconds;
+}
+
+bool identifySource(const std::string &source, SourceIdentity &identity) {
+
+    std::string directory = cacheDirectory();
+    struct stat info;
+    if (directory.empty() || stat(source.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+
+    char resolved[PATH_MAX];
+    std::string path = realpath(source.c_str(), resolved) ? resolved : source;
+
+    identity.size = (uint64_t)info.st_size;
+    identity.time = modificationTime(info);
+    identity.hash = hashString(path);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.raw", (unsigned long long)identity.hash);
+    identity.entry = directory + name;
+    return true;
+}
+
+static size_t pageSize() {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t)size : 4096;
+}
+
+// open the source's entry and check its header, -1 when it isn't usable
+static int openEntry(const SourceIdentity &identity, RawCacheHeader &header) {
+
+    int fd = open(identity.entry.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat info;
+    bool valid = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 fstat(fd, &info) == 0 &&
+                 memcmp(header.magic, RAW_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == RAW_CACHE_VERSION &&
+                 header.sourceSize == identity.size && header.sourceTime == identity.time &&
+                 header.sourceHash == identity.hash &&
+                 header.width > 0 && header.height > 0 &&
+                 header.width <= INT_MAX / 4 && header.height <= INT_MAX &&
+                 header.stride == 4 * (uint64_t)header.width &&  // images keep their rows packed
+                 header.dataOffset % pageSize() == 0 &&
+                 (uint64_t)info.st_size >= header.dataOffset + header.stride * header.height;
+    if (!valid) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool readRawCache(const SourceIdentity &identity, Image &image) {
+
+    RawCacheHeader header;
+    int fd = openEntry(identity, header);
+    if (fd < 0)
+        return false;
+
+    futimens(fd, nullptr);  // most recently used now, see trimCache
+    PixelBuffer pixels = PixelBuffer::mapFile(fd, header.dataOffset, header.stride * header.height);
+    close(fd);  // the mapping keeps the file around
+    if (!pixels.data())
+        return false;
+
+    image = Image(header.width, header.height, header.channels, std::move(pixels));
+    return true;
+}
+
+bool probeRawCache(const std::string &source, int &width, int &height, int &channels) {
+
+    SourceIdentity identity;
+    RawCacheHeader header;
+    if (!identifySource(source, identity))
+        return false;
+    int fd = openEntry(identity, header);
+    if (fd < 0)
+        return false;
+    close(fd);
+
+    width = header.width;
+    height = header.height;
+    channels = header.channels;
+    return true;
+}
+
+// mkdir -p
+static bool makeDirectories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+        if (slash == std::string::npos)
+            return true;
+    }
+}
+
+static bool writeAll(int fd, const void *data, size_t bytes) {
+    const char *next = (const char*)data;
+    while (bytes > 0) {
+        ssize_t written = write(fd, next, bytes);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        next += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+// whether a file name is one of writeRawCache's temporaries, <entry>.XXXXXX
+static bool temporaryName(const std::string &name) {
+    return name.size() > 11 && name.compare(name.size() - 11, 5, ".raw.") == 0;
+}
+
+// delete the least recently used entries(hits refresh the modification
+// time) till the rest fit in the budget, never the one just written. other
+// processes that have a deleted entry mapped keep their pixels.
+// temporaries count against the budget too, and the ones a crashed or failed
+// write left behind are deleted once they are STALE_WRITE_SECONDS old
+static void trimCache(const std::string &directory, const std::string &keep) {
+
+    DIR *listing = opendir(directory.c_str());
+    if (!listing)
+        return;
+
+    struct Entry {
+        std::string path;
+        int64_t used;
+        uint64_t bytes;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    int64_t stale = ((int64_t)time(nullptr) - STALE_WRITE_SECONDS) * 1000000000;
+
+    while (dirent *found = readdir(listing)) {
+        std::string name = found->d_name;
+        bool temporary = temporaryName(name);
+        if (!temporary && (name.size() < 4 || name.compare(name.size() - 4, 4, ".raw") != 0))
+            continue;
+
+        Entry entry;
+        struct stat info;
+        entry.path = directory + "/" + name;
+        if (stat(entry.path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        entry.used = modificationTime(info);
+        entry.bytes = (uint64_t)info.st_size;
+        if (temporary && entry.used < stale && unlink(entry.path.c_str()) == 0)
+            continue;
+        total += entry.bytes;
+        if (!temporary)
+            entries.push_back(entry);  // one still being written isn't ours to delete
+    }
+    closedir(listing);
+
+    uint64_t budget = cacheBudget();
+    if (total <= budget)
+        return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    for (size_t i = 0; i < entries.size() && total > budget; ++i)
+        if (entries[i].path != keep && unlink(entries[i].path.c_str()) == 0)
+            total -= entries[i].bytes;
+}
+
+bool writeRawCache(const std::string &source, const SourceIdentity &identity, Image &image) {
+
+    // a file that changed while it was decoded may not match the pixels
+    SourceIdentity now;
+    if (image.getWidth() == 0 || image.getHeight() == 0 || !identifySource(source, now) ||
+        now.size != identity.size || now.time != identity.time || now.entry != identity.entry)
+        return false;
+
+    // an image bigger than the whole budget would just push everything else out
+    if (pageSize() + 4 * (uint64_t)image.getWidth() * image.getHeight() > cacheBudget())
+        return false;
+
+    std::string directory = cacheDirectory();
+    if (!makeDirectories(directory))
+        return false;
+
+    RawCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAW_CACHE_MAGIC, sizeof(header.magic));
+    header.version = RAW_CACHE_VERSION;
+    header.width = image.getWidth();
+    header.height = image.getHeight();
+    header.channels = image.getChannels();
+    header.stride = 4 * (uint64_t)header.width;
+    header.dataOffset = pageSize();
+    header.sourceSize = identity.size;
+    header.sourceTime = identity.time;
+    header.sourceHash = identity.hash;
+
+    // the header padded out to the first page
+    std::vector<char> head(header.dataOffset, 0);
+    memcpy(head.data(), &header, sizeof(header));
+
+    std::vector<char> temporary(identity.entry.begin(), identity.entry.end());
+    const char suffix[] = ".XXXXXX";
+    temporary.insert(temporary.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(temporary.data());
+    if (fd < 0)
+        return false;
+    fchmod(fd, 0644);  // other processes get to map it too
+
+    bool ok = writeAll(fd, head.data(), head.size()) &&
+              writeAll(fd, image.getPixmap(), header.stride * header.height);
+    ok = close(fd) == 0 && ok;
+    if (ok)
+        ok = rename(temporary.data(), identity.entry.c_str()) == 0;
+    if (!ok)
+        unlink(temporary.data());
+
+    if (ok)
+        trimCache(directory, identity.entry);
+    return ok;
+}
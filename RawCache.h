@@ -0,0 +1,63 @@
+// Header file for the raw pixel cache.
+// decoded images are kept on disk as a fixed header followed by their RGBA
+// rows, starting on a page boundary, so that reading the same source again
+// maps the pixels straight in instead of decoding it. the mapping is copy on
+// write, so edits stay private while the untouched pages are shared with the
+// page cache and every other process that has the entry open.
+//
+// the cache is off unless $IP_RAW_CACHE names the directory the entries go
+// in. they are named after a hash of the source's path and are used only while
+// the source keeps the size and modification time it had when the entry was
+// written. every entry is a full uncompressed copy, so the directory is kept
+// under $IP_RAW_CACHE_MB megabytes(1024 by default) by deleting the least
+// recently used entries whenever a new one is written
+
+#ifndef RAW_CACHE_H
+#define RAW_CACHE_H
+
+#include "Image.h"
+#include <string>
+#include <stdint.h>
+
+#define RAW_CACHE_MAGIC "IPRAWPX\n"
+#define RAW_CACHE_VERSION 1
+#define RAW_CACHE_DEFAULT_MB 1024
+
+struct RawCacheHeader {
+    char magic[8];          // RAW_CACHE_MAGIC
+    uint32_t version;       // RAW_CACHE_VERSION
+    uint32_t width, height;
+    uint32_t channels;      // of the source, the rows are always RGBA
+    uint64_t stride;        // bytes from one row to the next
+    uint64_t dataOffset;    // where the first row starts, a multiple of the page size
+    uint64_t sourceSize;    // the source file as it was decoded
+    int64_t sourceTime;     // its modification time in nanoseconds
+    uint64_t sourceHash;    // of its absolute path
+};
+
+// what an entry has to say about its source to be valid, and where it is
+struct SourceIdentity {
+    uint64_t size;
+    int64_t time;
+    uint64_t hash;
+    std::string entry;
+};
+
+// stat the source, false when the cache is off or it isn't a regular file.
+// done before decoding, so that an entry never claims to hold a version of
+// the file newer than the pixels it was written from
+bool identifySource(const std::string &source, SourceIdentity &identity);
+
+// map the cached pixels of a source into image, false when there is no
+// valid entry for it(the image is left alone then)
+bool readRawCache(const SourceIdentity &identity, Image &image);
+
+// the dimensions of a cached source, without mapping anything
+bool probeRawCache(const std::string &source, int &width, int &height, int &channels);
+
+// store the pixels decoded from the source as it was identified. nothing is
+// written if the file changed since, and the entry is written under a
+// temporary name and renamed, so readers never see half of it
+bool writeRawCache(const std::string &source, const SourceIdentity &identity, Image &image);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+  resampling to any size, the same two passes as the convolution engine but
+  with a different window for every output pixel.
+
+  for every output column(and row) a table holds where its window starts in
+  the source and its weights, Q12 fixed point, with every window padded to
+  the same number of taps. when shrinking, the filter is stretched by the
+  scale factor so that every source pixel counts(no aliasing). the output is
+  cut into bands of rows; a band filters the source rows it reaches
+  horizontally into Q4 intermediates(resampleRow, which runs its vectors
+  along the window) and then runs its columns through convolveColumn, and
+  the bands are spread over all the cores.
+*/
+
+#include "Image.h"
+#include "RowSpan.h"
+#include "Kernels.h"
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#define FIXED_ONE (1 << 12)  // Q12 weights
+#define BAND_ROWS 64         // output rows per band
+
+// where every output pixel along one axis reads from
+struct ResampleTable {
+    int taps;                    // per output pixel, zero weights past the window
+    std::vector<int> starts;     // first source pixel of every window
+    std::vector<short> weights;  // taps per output pixel
+};
+
+static double sinc(double x) {
+    if (x == 0.0)
+        return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filterSupport(ResizeFilter filter) {
+    switch (filter) {
+        case RESIZE_BILINEAR: return 1.0;
+        case RESIZE_BICUBIC: return 2.0;
+        case RESIZE_LANCZOS3: return 3.0;
+        default: return 0.5;
+    }
+}
+
+static double filterWeight(ResizeFilter filter, double x) {
+    x = fabs(x);
+    switch (filter) {
+        case RESIZE_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case RESIZE_BICUBIC: {
+            // keys cubic with a = -0.5, catmull-rom
+            const double a = -0.5;
+            if (x < 1.0)
+                return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+            if (x < 2.0)
+                return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+            return 0.0;
+        }
+        case RESIZE_LANCZOS3:
+            return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+        default:
+            return x <= 0.5 ? 1.0 : 0.0;
+    }
+}
+
+static ResampleTable makeTable(int inSize, int outSize, ResizeFilter filter) {
+
+    double scale = (double)inSize / outSize;
+    double stretch = std::max(scale, 1.0);  // widen the filter when shrinking
+    double support = filterSupport(filter) * stretch;
+
+    ResampleTable table;
+    table.taps = std::min(inSize, (int)ceil(support) * 2 + 1);
+    table.starts.resize(outSize);
+    table.weights.assign((size_t)outSize * table.taps, 0);
+
+    std::vector<double> window(table.taps);
+    for (int x = 0; x < outSize; ++x) {
+
+        // pixel centers are at + 0.5
+        double center = (x + 0.5) * scale;
+        int lo = std::max(0, (int)floor(center - support));
+        int hi = std::min(inSize, (int)ceil(center + support));
+        hi = std::min(hi, lo + table.taps);
+
+        double sum = 0;
+        for (int i = lo; i < hi; ++i) {
+            window[i - lo] = filterWeight(filter, (i + 0.5 - center) / stretch);
+            sum += window[i - lo];
+        }
+
+        // windows near the edges get fewer pixels, so they are shifted back
+        // inside the image and padded with zeros
+        int start = std::min(lo, inSize - table.taps);
+        short *w = &table.weights[(size_t)x * table.taps + (lo - start)];
+
+        // rounding leftovers go to the heaviest tap so that flat areas stay flat
+        int total = 0, heaviest = 0;
+        for (int i = 0; i < hi - lo; ++i) {
+            w[i] = (short)lround(window[i] / sum * FIXED_ONE);
+            total += w[i];
+            if (w[i] > w[heaviest])
+                heaviest = i;
+        }
+        w[heaviest] += FIXED_ONE - total;
+
+        table.starts[x] = start;
+    }
+
+    return table;
+}
+
+// resampleRow takes every weight once per channel
+static std::vector<short> perChannel(const std::vector<short> &weights) {
+    std::vector<short> repeated(4 * weights.size());
+    for (size_t i = 0; i < repeated.size(); ++i)
+        repeated[i] = weights[i / 4];
+    return repeated;
+}
+
+Image Image::resize(int newWidth, int newHeight, ResizeFilter filter) {
+
+    if (newWidth <= 0 || newHeight <= 0 || width == 0 || height == 0)
+        return Image();
+
+    Image resized(newWidth, newHeight, channels);
+
+    if (filter == RESIZE_NEAREST) {
+        std::vector<int> columns(newWidth);
+        for (int x = 0; x < newWidth; ++x)
+            columns[x] = std::min(width - 1, (int)((x + 0.5) * width / newWidth));
+
+        parallelRows(resized, BAND_ROWS, [&](const RowSpan &out) {
+            const unsigned char *in = row(std::min(height - 1, (int)((out.y + 0.5) * height / newHeight)));
+            for (int x = 0; x < out.width; ++x)
+                memcpy(out.at(x), in + 4 * columns[x], 4);
+        });
+        return resized;
+    }
+
+    ResampleTable horizontal = makeTable(width, newWidth, filter);
+    ResampleTable vertical = makeTable(height, newHeight, filter);
+    std::vector<short> horizontalWeights = perChannel(horizontal.weights);
+    size_t span = 4 * (size_t)newWidth;
+
+    parallelBands(newHeight, BAND_ROWS, [&](int y0, int y1) {
+
+        const KernelTable &k = kernels();
+
+        // the windows only move down, so the band reads the source rows from
+        // its first window's start to its last window's end
+        int first = vertical.starts[y0];
+        int last = vertical.starts[y1 - 1] + vertical.taps;
+
+        std::vector<short> scratch((last - first) * span);
+        for (int y = first; y < last; ++y)
+            k.resampleRow(row(y), &scratch[(y - first) * span], newWidth,
+                          horizontal.starts.data(), horizontalWeights.data(), horizontal.taps);
+
+        std::vector<const short*> rows(vertical.taps);
+        for (int y = y0; y < y1; ++y) {
+            for (int j = 0; j < vertical.taps; ++j)
+                rows[j] = &scratch[(vertical.starts[y] + j - first) * span];
+            k.convolveColumn(rows.data(), resized.row(y), span,
+                             &vertical.weights[(size_t)y * vertical.taps], vertical.taps);
+        }
+    });
+
+    return resized;
+}
+
+Image Image::resizeToFit(int maxWidth, int maxHeight, ResizeFilter filter) {
+
+    if (width <= maxWidth && height <= maxHeight)
+        return clone();
+
+    double scale = std::min(maxWidth / (double)width, maxHeight / (double)height);
+    int w = std::max(1, (int)lround(width * scale));
+    int h = std::max(1, (int)lround(height * scale));
+    return resize(w, h, filter);
+}
@@ -0,0 +1,141 @@
+// Header file for walking over the pixels of an image a row at a time.
+// a RowSpan is one scanline(or the part of it inside a rectangle) as a plain
+// pointer to RGBA bytes and a width. the templates below hand the rows, bands
+// of rows or tiles of an image to a lambda, so that the loop inside it runs
+// over contiguous memory the compiler can vectorize, instead of going through
+// pixelAt/setPixelAt. the parallel ones spread the bands or tiles over the
+// compute pool, see parallelFor
+
+#ifndef ROW_SPAN_H
+#define ROW_SPAN_H
+
+#include "Image.h"
+#include "ThreadPool.h"
+#include <vector>
+#include <algorithm>
+
+struct RowSpan {
+    unsigned char *data;  // the first pixel's bytes
+    int width;            // in pixels
+    int y;                // row of the image it belongs to
+
+    unsigned char* begin() const { return data; }
+    unsigned char* end() const { return data + 4 * (size_t)width; }
+    unsigned char* at(int x) const { return data + 4 * (size_t)x; }
+
+    pixel get(int x) const {
+        const unsigned char *p = at(x);
+        return pixel(p[0], p[1], p[2], p[3]);
+    }
+
+    void set(int x, const pixel &color) const {
+        unsigned char *p = at(x);
+        p[0] = color.r;
+        p[1] = color.g;
+        p[2] = color.b;
+        p[3] = color.a;
+    }
+};
+
+inline RowSpan Image::rowSpan(int y) {
+    RowSpan span = { row(y), width, y };
+    return span;
+}
+
+inline RowSpan ImageRect::rowSpan(Image &image, int y) const {
+    RowSpan span = { image.row(y) + 4 * (size_t)x0, x1 - x0, y };
+    return span;
+}
+
+// cover the area with tiles of at most tileWidth x tileHeight, row by row
+inline std::vector<ImageRect> makeTiles(const ImageRect &area, int tileWidth, int tileHeight) {
+
+    std::vector<ImageRect> tiles;
+    for (int y = area.y0; y < area.y1; y += tileHeight) {
+        for (int x = area.x0; x < area.x1; x += tileWidth) {
+            ImageRect tile = { x, std::min(area.x1, x + tileWidth), y, std::min(area.y1, y + tileHeight) };
+            tiles.push_back(tile);
+        }
+    }
+
+    return tiles;
+}
+
+// body(RowSpan) on the part of every row of the area inside it, top to bottom
+template <class Body>
+void forEachRow(Image &image, const ImageRect &area, Body body) {
+    for (int y = area.y0; y < area.y1; ++y)
+        body(area.rowSpan(image, y));
+}
+
+// body(RowSpan) on rows [firstRow, lastRow), top to bottom
+template <class Body>
+void forEachRow(Image &image, int firstRow, int lastRow, Body body) {
+    for (int y = firstRow; y < lastRow; ++y)
+        body(image.rowSpan(y));
+}
+
+template <class Body>
+void forEachRow(Image &image, Body body) {
+    forEachRow(image, 0, image.getHeight(), body);
+}
+
+// f(pixel) on every pixel, in order
+template <class F>
+void forEachPixel(Image &image, F f) {
+    forEachRow(image, [&f](const RowSpan &row) {
+        for (const unsigned char *p = row.begin(), *end = row.end(); p != end; p += 4)
+            f(pixel(p[0], p[1], p[2], p[3]));
+    });
+}
+
+// body(firstRow, lastRow) on bands of bandRows rows covering [firstRow,
+// lastRow), the bands spread over the compute pool
+template <class Body>
+void parallelBands(int firstRow, int lastRow, int bandRows, Body body) {
+
+    if (lastRow <= firstRow)
+        return;
+
+    size_t bands = (lastRow - firstRow + bandRows - 1) / bandRows;
+    parallelFor(bands, [&](size_t band) {
+        int first = firstRow + (int)band * bandRows;
+        body(first, std::min(lastRow, first + bandRows));
+    });
+}
+
+template <class Body>
+void parallelBands(int rows, int bandRows, Body body) {
+    parallelBands(0, rows, bandRows, body);
+}
+
+// body(RowSpan) on every row, bands of bandRows rows at a time on the compute pool
+template <class Body>
+void parallelRows(Image &image, int bandRows, Body body) {
+    parallelBands(image.getHeight(), bandRows, [&](int first, int last) {
+        forEachRow(image, first, last, body);
+    });
+}
+
+// body(const ImageRect&) on every tile, spread over the compute pool
+template <class Body>
+void parallelTiles(const std::vector<ImageRect> &tiles, Body body) {
+    parallelFor(tiles.size(), [&](size_t i) { body(tiles[i]); });
+}
+
+// every pixel replaced by f(pixel). f mustn't care about the order, the
+// bands of rows run concurrently
+template <class F>
+void transformPixels(Image &image, F f) {
+    parallelRows(image, 64, [&f](const RowSpan &row) {
+        for (unsigned char *p = row.begin(), *end = row.end(); p != end; p += 4) {
+            pixel color = f(pixel(p[0], p[1], p[2], p[3]));
+            p[0] = color.r;
+            p[1] = color.g;
+            p[2] = color.b;
+            p[3] = color.a;
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+  worker threads shared by everything that wants to run work concurrently
+*/
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads) : inflight(0), stopping(false) {
+
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;  // hardware_concurrency() may not know
+
+    for (int i = 0; i < threads; ++i)
+        workers.push_back(std::thread(&ThreadPool::run, this));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+        inflight++;
+    }
+    wakeup.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    drained.wait(guard, [this] { return inflight == 0; });
+}
+
+size_t ThreadPool::pending() {
+    std::lock_guard<std::mutex> guard(lock);
+    return inflight;
+}
+
+// every worker drains the queue till we are told to stop and nothing is left
+void ThreadPool::run() {
+
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeup.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;  // stopping and nothing left to do
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            inflight--;
+        }
+        drained.notify_all();
+    }
+}
+
+ThreadPool& ThreadPool::compute() {
+    static ThreadPool *pool = new ThreadPool();
+    return *pool;
+}
+
+// the state of one parallelFor, shared with the helpers so that the ones that
+// only get to run after the loop is over still have something valid to look at
+struct ParallelLoop {
+    std::function<void(size_t)> body;
+    size_t count;
+    std::atomic<size_t> next, done;
+    std::mutex lock;
+    std::condition_variable finished;
+
+    ParallelLoop(const std::function<void(size_t)> &body, size_t count) :
+        body(body), count(count), next(0), done(0) {}
+
+    void work() {
+        size_t i;
+        while ((i = next++) < count) {
+            body(i);
+            if (++done == count) {
+                std::lock_guard<std::mutex> guard(lock);
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+void parallelFor(size_t count, const std::function<void(size_t)> &body) {
+
+    ThreadPool &pool = ThreadPool::compute();
+    if (count <= 1 || pool.size() <= 1) {
+        for (size_t i = 0; i < count; ++i)
+            body(i);
+        return;
+    }
+
+    std::shared_ptr<ParallelLoop> loop(new ParallelLoop(body, count));
+    size_t helpers = std::min(count - 1, pool.size());
+    for (size_t i = 0; i < helpers; ++i)
+        pool.submit([loop] { loop->work(); });
+
+    loop->work();
+
+    std::unique_lock<std::mutex> guard(loop->lock);
+    loop->finished.wait(guard, [&loop] { return loop->done == loop->count; });
+}
@@ -0,0 +1,51 @@
+// Header file for a fixed size pool of worker threads.
+// tasks are run in the order they were submitted, by whichever worker is free.
+// parallelFor spreads a loop over the shared compute pool
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex lock;
+    std::condition_variable wakeup;   // signalled when a task is queued or on shutdown
+    std::condition_variable drained;  // signalled every time a task finishes
+    size_t inflight;                  // queued + currently running
+    bool stopping;
+
+    void run();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+public:
+    explicit ThreadPool(int threads = 0);  // 0 means one per core
+    ~ThreadPool();  // runs everything still queued before returning
+
+    void submit(std::function<void()> task);
+
+    // block until every submitted task has finished
+    void wait();
+
+    size_t size() const { return workers.size(); }
+    size_t pending();
+
+    // one worker per core, shared by every image operation that splits
+    // its work up(never destroyed, like the pixel pool)
+    static ThreadPool& compute();
+};
+
+// run body(0) .. body(count - 1) on the compute pool, with the calling thread
+// helping out, and return once every index is done. the body must not call
+// parallelFor itself
+void parallelFor(size_t count, const std::function<void(size_t)> &body);
+
+#endif
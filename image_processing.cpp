@@ -8,7 +8,12 @@
 #include <OpenImageIO/imageio.h>
 #include <iostream>
 #include "Image.h"
+#include "ImageIO.h"
+#include "Kernels.h"
+#include "JobServer.h"
+#include "DisplayCache.h"
 #include <vector>
+#include <memory>
 
 #ifdef __APPLE__
 #  pragma clang diagnostic ignored "-Wdeprecated-declarations"
@@ -35,7 +40,46 @@ char** imagenames;  // list of image names supplied in the command line args
 
 string currentImageName = "";  // the name of the image on file currently being displayed
 
-Image *picture = NULL;  // a reference stored to the Image object
+unique_ptr<Image> picture;  // the Image object being displayed, owns its pixels
+
+// after a palette operation the picture is kept as palette indices instead,
+// a quarter to a 32nd of its size, and picture is let go. written paletted,
+// and only expanded back to RGBA when an operation needs the pixels
+IndexedImage quantized;
+
+// saves images without blocking the display. only the window needs one, so
+// its thread is started there and not in the server or test modes
+unique_ptr<AsyncImageWriter> writer;
+
+ColorSpace matchSpace = SPACE_SRGB;  // where palette colors get compared, 'l' cycles through them
+
+// the picture's texture, and what of it has to be sent again on the next redraw
+GLuint texture = 0;
+DisplayCache display;
+
+// whether there is anything to show, either way it is stored
+bool loaded() {
+    return picture || quantized.getWidth() > 0;
+}
+
+// the picture as RGBA, for the operations that need the pixels
+Image& pixels() {
+    if (!picture) {
+        picture.reset(new Image(quantized.toImage()));
+        quantized = IndexedImage();
+    }
+    return *picture;
+}
+
+// keep the result of a palette operation in place of the picture(palettes of
+// more than 256 colors have no indexed form, the picture stays then)
+void keepIndexed(IndexedImage &&result) {
+    if (result.getWidth() == 0)
+        return;
+    quantized = std::move(result);
+    picture.reset();
+    display.invalidate();
+}
 
 /*
   read an image from the file whose name is specified in the argument.
@@ -57,58 +101,25 @@ void readimage(string name="") {
     // string filepath = "/home/abhinit/Documents/codeblocks/test/images/" + inputfilename;
     currentImageName = inputfilename;  // set the current image name
 
-    // read the image
-    ImageInput* input = ImageInput::open(inputfilename);
-    if (! input) {
-        cerr << "Could not read image " << inputfilename << ", error = " << geterror() << endl;
-        return;
-    }
-
-    const ImageSpec &spec = input->spec();
-    // get the metadata for the image(dimensions and number of channels)
-    int width = spec.width;
-    int height = spec.height;
-    int channels = spec.nchannels;
-
-    // allocate space in memory to store the image data
-    unsigned char pixmap[channels * width * height];
-
-    if (!input->read_image(TypeDesc::UINT8, pixmap)) {
-        cerr << "Could not read image " << inputfilename << ", error = " << geterror() << endl;
-        ImageInput::destroy (input);
+    // read the image, this releases the old one if it exists
+    unique_ptr<Image> image(new Image());
+    if (!readImageFile(inputfilename, *image))
         return;
-    }
-    // close the file handle
-    if (!input->close()) {
-      cerr << "Could not close " << inputfilename << ", error = " << geterror() << endl;
-      ImageInput::destroy (input);
-      return;
-    }
-
-    ImageInput::destroy(input);
-
-    // before reading a new image, destroy the old one if it exists
-    if (picture) {
-        picture->destroy();
-        delete picture;
-    }
 
-    // copy the pixmap into the image
-    picture = new Image(width, height, channels);
-    picture->copyImage(pixmap);   // make a deep copy of the pixmap
+    picture = std::move(image);
+    quantized = IndexedImage();
 }
 
 /*
-    Routine to write the current framebuffer to an image file
+    Routine to write the current image to an image file.
+    the pixels are snapshotted right away and encoded on the background writer,
+    so the window stays responsive while a big image is being compressed
 */
 void writeimage(){
 
-    if (!picture)
+    if (!loaded())
         return;
 
-    int w = picture->getWidth();
-    int h = picture->getHeight();
-
     string outfilename;
 
     // get a filename for the image. The file suffix should indicate the image file
@@ -116,41 +127,13 @@ void writeimage(){
     cout << "enter output image filename: ";
     cin >> outfilename;
 
-    // create the oiio file handler for the image
-    ImageOutput *outfile = ImageOutput::create(outfilename);
-    if(!outfile){
-        cerr << "Could not create output image for " << outfilename << ", error = " << geterror() << endl;
-        return;
-    }
-
-    // open a file for writing the image. The file header will indicate an image of
-    // width w, height h, and 4 channels per pixel (RGBA). All channels will be of
-    // type unsigned char
-    ImageSpec spec(w, h, 4, TypeDesc::UINT8);
-    if(!outfile->open(outfilename, spec)){
-        cerr << "Could not open " << outfilename << ", error = " << geterror() << endl;
-        ImageOutput::destroy (outfile);
-        return;
-    }
-
-    // write the image to the file. All channel values in the pixmap are taken to be
-    // unsigned chars
-    if(!outfile->write_image(TypeDesc::UINT8, picture->getPixmap())){
-        cerr << "Could not write image to " << outfilename << ", error = " << geterror() << endl;
-        ImageOutput::destroy (outfile);
-        return;
-    }
+    // quantized images go out paletted(png, gif, bmp, pbm), anything else
+    // drops the channels it doesn't need
+    if (quantized.getWidth() > 0)
+        writer->save(outfilename, quantized);
     else
-        cout << "Saved successfully." << endl;
-
-    // free up space associated with the oiio file handler
-    if (!outfile->close()) {
-      cerr << "Could not close " << outfilename << ", error = " << geterror() << endl;
-      ImageOutput::destroy (outfile);
-      return;
-    }
-
-    ImageOutput::destroy (outfile);
+        writer->save(outfilename, *picture);
+    cout << "Saving " << outfilename << " in the background." << endl;
 }
 /*
    Reshape Callback Routine: sets up the viewport and drawing coordinates
@@ -174,31 +157,53 @@ void handleReshape(int w, int h) {
 
 /*
   this is the main display routine
-  using pixelZoom to always fit the image into the display window
-  in the end, we flip the image so that it doesn't display upside down
+  the picture lives in a texture stretched over the whole window, and only
+  the rows that changed since the last redraw are sent to it(see DisplayCache.h).
+  the texture's first row is put at the top of the window, so the image
+  doesn't display upside down without flipping it
 */
 void drawImage() {
 
-    if (picture) {
+    if (loaded()) {
 
         glClear(GL_COLOR_BUFFER_BIT);  // clear window to background color
 
-        int width = picture->getWidth();
-        int height = picture->getHeight();
-
-        // ensure that the image is centered
-        glRasterPos2i(0, 0);
-
-        // zoom the image according to the window size
-        double xr = windowWidth / (double)width;
-        double yr = windowHeight / (double)height;
-        glPixelZoom(xr, yr);
+        if (!texture) {
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            display.invalidate();
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+
+        bool reallocate;
+        vector<RowRange> rows = picture ? display.update(*picture, windowWidth, windowHeight, reallocate)
+                                        : display.update(quantized, windowWidth, windowHeight, reallocate);
+        int width = display.getTextureWidth();
+
+        if (reallocate)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, display.getTextureHeight(), 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            for (int first = rows[i].first; first < rows[i].last; first += DISPLAY_BAND_ROWS) {
+                int last = min(first + DISPLAY_BAND_ROWS, rows[i].last);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, width, last - first,
+                                GL_RGBA, GL_UNSIGNED_BYTE, display.pixels(first, last));
+            }
+        }
 
-        // flip the image so that we can see it straight
-        Image* flipped = picture->flip();
-        glDrawPixels(width, height, GL_RGBA, GL_UNSIGNED_BYTE, flipped->getPixmap());
-        flipped->destroy();
-        delete flipped;
+        glEnable(GL_TEXTURE_2D);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2i(0, windowHeight);
+        glTexCoord2f(1, 0); glVertex2i(windowWidth, windowHeight);
+        glTexCoord2f(1, 1); glVertex2i(windowWidth, 0);
+        glTexCoord2f(0, 1); glVertex2i(0, 0);
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
 
         glFlush();
     }
@@ -213,7 +218,7 @@ void handleKey(unsigned char key, int x, int y) {
         case 'r':
         case 'R':
             readimage();
-            if (picture)
+            if (loaded())
                 glutPostRedisplay();
             break;
         case 'w':
@@ -223,15 +228,15 @@ void handleKey(unsigned char key, int x, int y) {
         case 'p':
         case 'P':
             // convert to bitmap
-            if (picture) {
-                picture->toBitmap();
+            if (loaded()) {
+                keepIndexed(pixels().toBitmapIndexed());
                 glutPostRedisplay();
             }
             break;
         case 'd':
         case 'D':
             // reduce the palette
-            if (picture) {
+            if (loaded()) {
               // std::vector<pixel> palette(2, pixel());
               /*
               palette.push_back(pixel(64, 49, 174, 255));
@@ -256,16 +261,19 @@ void handleKey(unsigned char key, int x, int y) {
               palette.push_back(pixel(255, 255, 255, 255));
               palette.push_back(pixel(0, 0, 0, 255));
 
-              picture->reducePalette(palette);
+              keepIndexed(pixels().reducePaletteIndexed(palette, matchSpace));
               glutPostRedisplay();
             }
             break;
 
         case 'c':
         case 'C':
-            if (picture) {
+            if (loaded()) {
               std::vector<pixel> colors(16, pixel());  // 16 colors
-              picture->getReducedPalette(colors);
+              if (picture)
+                picture->getReducedPalette(colors, matchSpace);
+              else
+                quantized.toImage().getReducedPalette(colors, matchSpace);
 
               for (int i = 0; i < 16; ++i)
                 std::cout << "(" << (int)colors[i].r << ", " << (int)colors[i].g << ", " << (int)colors[i].b << ")\n";
@@ -274,38 +282,38 @@ void handleKey(unsigned char key, int x, int y) {
 
         case 'f':
         case 'F':
-            if (picture) {
+            if (loaded()) {
               std::vector<pixel> palette(16, pixel());
 
-              picture->getReducedPalette(palette);
+              pixels().getReducedPalette(palette, matchSpace);
               // std::vector<pixel> palette;
               // palette.push_back(pixel(255, 255, 255, 255));
               // palette.push_back(pixel(0, 0, 0, 255));
-              picture->floydSteinberg(palette);
+              keepIndexed(pixels().floydSteinbergIndexed(palette, matchSpace));
               glutPostRedisplay();
             }
             break;
 
         case '1':
             // red
-            if (picture) {
-                picture->greyscaleRed();
+            if (loaded()) {
+                pixels().greyscaleRed();
                 cout << "Hit 'o' to get the original image back before doing any other operation\n";
                 glutPostRedisplay();
             }
             break;
         case '2':
             // green
-            if (picture) {
-                picture->greyscaleGreen();
+            if (loaded()) {
+                pixels().greyscaleGreen();
                 cout << "Hit 'o' to get the original image back before doing any other operation\n";
                 glutPostRedisplay();
             }
             break;
         case '3':
             // blue
-            if (picture) {
-                picture->greyscaleBlue();
+            if (loaded()) {
+                pixels().greyscaleBlue();
                 cout << "Hit 'o' to get the original image back before doing any other operation\n";
                 glutPostRedisplay();
             }
@@ -318,18 +326,41 @@ void handleKey(unsigned char key, int x, int y) {
             //  read the current image
             readimage(currentImageName);
 
-            if (picture)
+            if (loaded())
                 glutPostRedisplay();
             break;
+        case 'l':
+        case 'L':
+            // cycle the color space used by the palette operations
+            matchSpace = (ColorSpace)((matchSpace + 1) % (SPACE_OKLAB + 1));
+            cout << "Matching colors in " << colorSpaceName(matchSpace) << "\n";
+            break;
+        case 'b':
+        case 'B':
+            // soften the picture, e.g. before reducing its palette
+            if (loaded()) {
+                pixels().gaussianBlur(2.0f);
+                glutPostRedisplay();
+            }
+            break;
+        case 's':
+        case 'S':
+            // sharpen it back up
+            if (loaded()) {
+                pixels().unsharpMask(1.5f, 1.0f, 2);
+                glutPostRedisplay();
+            }
+            break;
         case 'i':
-            if (picture) {
-                picture->inverse();
+            if (loaded()) {
+                pixels().inverse();
                 glutPostRedisplay();
             }
             break;
         case 'q':		// q - quit
         case 'Q':
         case 27:		// esc - quit
+            writer->wait();  // don't lose any save that is still in flight
             exit(0);
         default:		// not a valid key -- just ignore it
             return;
@@ -360,17 +391,71 @@ void handleArrowKeys(int key, int x, int y) {
     // read the image at the given index
     readimage(imagenames[ipicture]);
 
-    if (picture)
+    if (loaded())
         glutPostRedisplay();
 }
 
+/*
+  server mode: image_processing --serve [socket] [--threads n] [--memory mb] [--cache mb]
+  reads jobs from stdin when no socket is given
+*/
+int serve(int argc, char* argv[]) {
+
+    ServerOptions options;
+    string socket;
+
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 < argc && arg == "--threads")
+            options.threads = atoi(argv[++i]);
+        else if (i + 1 < argc && arg == "--memory")
+            options.memoryLimit = (size_t)atol(argv[++i]) << 20;
+        else if (i + 1 < argc && arg == "--cache")
+            options.imageCacheBytes = (size_t)atol(argv[++i]) << 20;
+        else if (arg[0] != '-' && socket.empty())
+            socket = arg;
+        else {
+            cerr << "usage: " << argv[0] << " --serve [socket] [--threads n] [--memory mb] [--cache mb]\n";
+            return 1;
+        }
+    }
+
+    JobServer server(options);
+    if (!socket.empty())
+        return server.serveSocket(socket) ? 0 : 1;
+
+    // the answers own stdout, anything else that gets printed goes to stderr
+    ostream answers(cout.rdbuf());
+    cout.rdbuf(cerr.rdbuf());
+    server.serveStream(cin, answers);
+    return 0;
+}
+
 /*
    Main program to draw the square, change colors, and wait for quit
 */
 int main(int argc, char* argv[]) {
 
+    // check that every kernel build this cpu can run agrees with the scalar
+    // one, that redraws send just what changed, that the heaviest filter taps
+    // hold in fixed point and that GIFs decode
+    if (argc > 1 && string(argv[1]) == "--selftest") {
+        bool ok = kernelSelfCheck(cout);
+        ok = displaySelfCheck(cout) && ok;
+        ok = filterSelfCheck(cout) && ok;
+        ok = gifSelfCheck(cout) && ok;
+        return ok ? 0 : 1;
+    }
+
+    // no window in these modes, see JobServer.h
+    if (argc > 1 && string(argv[1]) == "--serve")
+        return serve(argc, argv);
+    if (argc > 2 && string(argv[1]) == "--client")
+        return runJobClient(argv[2], cin, cout);
+
     imagenames = argv + 1;
     num = argc - 1;
+    writer.reset(new AsyncImageWriter());
 
     cout << "Args: " << num << "\n";
 